@@ -0,0 +1,669 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/wait.h>
+
+// Limits for the collected measurements
+#define MAX_RUNS 101
+#define MAX_METRICS 64
+#define MAX_NAME 64
+
+// Seconds after which a single benchmark run is killed
+#define RUN_TIMEOUT 60
+
+// Maximum number of arguments of a hypervisor command line
+#define MAX_ARGS 32
+
+// Maximum length of the name of the host processor
+#define MAX_HOST 128
+
+// Structure describing one benchmark: a hypervisor variant running a set of guests
+struct benchmark {
+    const char* name; // Name used as the prefix of the reported metrics
+    const char* dir; // Directory of the variant, relative to the repository root
+    const char* target; // Make target building the guest images
+    const char* const* argv; // Command line of the hypervisor
+    const char* input; // Data fed to the hypervisor standard input, NULL for none
+    const char* results; // File with "name value" lines written by the guest, NULL for none
+    const char* exit_line; // Line the hypervisor prints for each guest that reaches its exit
+    int guests; // Number of guests, a run fails unless all of them reach their exit
+    int cpu_option; // Nonzero if the hypervisor takes --cpu
+};
+
+// Structure representing the samples and statistics of one metric
+struct metric {
+    char name[MAX_NAME]; // Name of the metric
+    double samples[MAX_RUNS]; // Value measured in each run
+    int count; // Number of samples
+    double median; // Median of the samples
+    double ci_low; // Lower bound of the 95% confidence interval of the median
+    double ci_high; // Upper bound of the 95% confidence interval of the median
+    int info; // Set for values that are not timings, they are reported but never compared
+};
+
+static const char* const nivoA_argv[] = {"./mini_hypervisor", "--memory", "4", "--page", "2", "--guest", "guest.img", NULL};
+static const char* const nivoB_argv[] = {"./mini_hypervisor", "--memory", "4", "--page", "2", "--guest", "guest1.img", "guest2.img", "guest3.img", NULL};
+static const char* const nivoC_argv[] = {"./mini_hypervisor", "-m", "4", "-p", "2", "-g", "guest1.img", "guest2.img", "guest3.img", NULL};
+static const char* const nivoC_bench_argv[] = {"./mini_hypervisor", "-m", "4", "-p", "2", "--disk", "bench.disk", "--irqchip", "--shm", "2", "-g", "bench.img", NULL};
+
+// Benchmarks run by the harness
+static const struct benchmark benchmarks[] = {
+    {"nivoA", "nivoA", "guest.img", nivoA_argv, "3\n4\n", NULL, "KVM_EXIT_HLT\n", 1, 0},
+    {"nivoB", "nivoB", "guest.img", nivoB_argv, NULL, NULL, "KVM_EXIT_HLT\n", 3, 0},
+    {"nivoC", "nivoC", "guest.img", nivoC_argv, NULL, NULL, " exit\n", 3, 1},
+    {"nivoC-bench", "nivoC", "bench.img bench.disk", nivoC_bench_argv, NULL, "vm_0_bench.txt", " exit\n", 1, 1},
+};
+
+#define NUM_BENCHMARKS (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+struct metric metrics[MAX_METRICS]; // Metrics collected in this session
+int num_metrics = 0; // Number of collected metrics
+const char* cpu_model = NULL; // CPU model given to the guests of hypervisors taking --cpu, NULL for their default
+
+/**
+ * Adds a sample to a metric, creating the metric if it does not exist yet.
+ *
+ * @param name Name of the metric.
+ * @param value Measured value.
+ * @return Pointer to the metric, NULL if there is no room for it.
+ */
+struct metric* add_sample(const char* name, double value) {
+    int i;
+    for (i = 0; i < num_metrics && strcmp(metrics[i].name, name) != 0; i++);
+
+    if (i == num_metrics) {
+        if (num_metrics == MAX_METRICS) return NULL;
+        snprintf(metrics[i].name, MAX_NAME, "%s", name);
+        metrics[i].count = 0;
+        metrics[i].info = 0;
+        num_metrics++;
+    }
+
+    if (metrics[i].count < MAX_RUNS) {
+        metrics[i].samples[metrics[i].count++] = value;
+    }
+    return &metrics[i];
+}
+
+/**
+ * Tells whether a value reported by a guest is a timing, from the unit at the end of its name.
+ *
+ * @param key Name of the value.
+ * @return 1 for timings (_kcycles or _ms), 0 for other values such as the features a guest detected.
+ */
+int is_timing(const char* key) {
+    const char* units[] = {"_kcycles", "_ms"};
+    size_t len = strlen(key);
+
+    for (int i = 0; i < 2; i++) {
+        size_t unit = strlen(units[i]);
+        if (len > unit && strcmp(key + len - unit, units[i]) == 0) return 1;
+    }
+    return 0;
+}
+
+/**
+ * Compares two doubles, used for sorting the samples.
+ *
+ * @param a Pointer to the first value.
+ * @param b Pointer to the second value.
+ * @return Negative, zero or positive value as in qsort.
+ */
+int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Computes the median of a metric and a distribution-free 95% confidence interval for it,
+ * using the order statistics at ranks n/2 -+ 1.96 * sqrt(n) / 2.
+ *
+ * @param m Pointer to the metric.
+ */
+void compute_stats(struct metric* m) {
+    double sorted[MAX_RUNS];
+    int n = m->count;
+
+    memcpy(sorted, m->samples, sizeof(double) * n);
+    qsort(sorted, n, sizeof(double), compare_doubles);
+
+    m->median = n % 2 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+
+    int low = (int)floor(n / 2.0 - 1.96 * sqrt(n) / 2); // 1-based rank of the lower bound
+    int high = (int)ceil(1 + n / 2.0 + 1.96 * sqrt(n) / 2); // 1-based rank of the upper bound
+    if (low < 1) low = 1;
+    if (high > n) high = n;
+    m->ci_low = sorted[low - 1];
+    m->ci_high = sorted[high - 1];
+}
+
+/**
+ * Builds the hypervisor and the guest images of a variant with its Makefile.
+ *
+ * @param root Repository root.
+ * @param dir Variant directory.
+ * @param target Make target building the guest images.
+ * @return 0 on success, -1 on failure.
+ */
+int build_variant(const char* root, const char* dir, const char* target) {
+    char command[512];
+    snprintf(command, sizeof(command), "make -s -C %s/%s mini_hypervisor %s > /dev/null", root, dir, target);
+    return system(command) == 0 ? 0 : -1;
+}
+
+/**
+ * Counts the guests of a run that reached their exit, from the output of the hypervisor.
+ *
+ * @param b Pointer to the benchmark.
+ * @param output Output of the hypervisor.
+ * @return Number of exit lines in the output.
+ */
+int count_exits(const struct benchmark* b, FILE* output) {
+    char line[256];
+    size_t len = strlen(b->exit_line);
+    int exits = 0;
+
+    rewind(output);
+    while (fgets(line, sizeof(line), output)) {
+        size_t n = strlen(line);
+        if (n >= len && strcmp(line + n - len, b->exit_line) == 0) exits++;
+    }
+
+    return exits;
+}
+
+/**
+ * Runs the hypervisor of a benchmark once and measures its wall-clock time. A run fails unless the
+ * hypervisor exits with status 0 and every guest reaches its exit.
+ *
+ * @param b Pointer to the benchmark.
+ * @param root Repository root.
+ * @param elapsed_ms Pointer where the elapsed time in milliseconds is stored.
+ * @return 0 on success, -1 if the run failed.
+ */
+int run_once(const struct benchmark* b, const char* root, double* elapsed_ms) {
+    char dir[512];
+    snprintf(dir, sizeof(dir), "%s/%s", root, b->dir);
+
+    // Prepare the standard input of the hypervisor
+    FILE* input = tmpfile();
+    if (input == NULL) {
+        perror("ERROR: Unable to create input file");
+        return -1;
+    }
+    if (b->input) fputs(b->input, input);
+    fflush(input);
+    rewind(input);
+
+    // Capture the output of the hypervisor, it tells which guests reached their exit
+    FILE* output = tmpfile();
+    if (output == NULL) {
+        perror("ERROR: Unable to create output file");
+        fclose(input);
+        return -1;
+    }
+
+    // Give the CPU model right after the program name
+    const char* args[MAX_ARGS];
+    int num_args = 0;
+    args[num_args++] = b->argv[0];
+    if (cpu_model && b->cpu_option) {
+        args[num_args++] = "--cpu";
+        args[num_args++] = cpu_model;
+    }
+    for (int i = 1; b->argv[i] && num_args < MAX_ARGS - 1; i++) {
+        args[num_args++] = b->argv[i];
+    }
+    args[num_args] = NULL;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("ERROR: Failed fork");
+        fclose(input);
+        fclose(output);
+        return -1;
+    }
+
+    if (pid == 0) {
+        // Child: run the hypervisor in the variant directory with its output captured
+        dup2(fileno(input), STDIN_FILENO);
+        dup2(fileno(output), STDOUT_FILENO);
+        dup2(fileno(output), STDERR_FILENO);
+        if (chdir(dir) < 0) _exit(127);
+        alarm(RUN_TIMEOUT); // Kill guests that never halt
+        execv(args[0], (char* const*)args);
+        _exit(127);
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fclose(input);
+    int exits = count_exits(b, output);
+    fclose(output);
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "ERROR: Benchmark %s failed (status 0x%x)\n", b->name, status);
+        return -1;
+    }
+    if (exits < b->guests) {
+        fprintf(stderr, "ERROR: Benchmark %s failed, %d of %d guests reached their exit\n", b->name, exits, b->guests);
+        return -1;
+    }
+
+    *elapsed_ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    return 0;
+}
+
+/**
+ * Collects the "name value" lines reported by the benchmark guest as metrics. Values that are not timings
+ * are kept as information.
+ *
+ * @param b Pointer to the benchmark.
+ * @param root Repository root.
+ * @return Number of metrics reported, -1 if the guest wrote no report.
+ */
+int collect_results(const struct benchmark* b, const char* root) {
+    char path[512], key[MAX_NAME], name[2 * MAX_NAME];
+    double value;
+    int count = 0;
+
+    snprintf(path, sizeof(path), "%s/%s/%s", root, b->dir, b->results);
+    FILE* f = fopen(path, "r");
+    if (f == NULL) return -1;
+
+    while (fscanf(f, "%63s %lf", key, &value) == 2) {
+        snprintf(name, sizeof(name), "%s.%s", b->name, key);
+        struct metric* m = add_sample(name, value);
+        if (m) m->info = !is_timing(key);
+        count++;
+    }
+
+    fclose(f);
+    unlink(path); // Make sure a stale report is never read twice
+    return count;
+}
+
+/**
+ * Removes the report of a run that is not measured.
+ *
+ * @param b Pointer to the benchmark.
+ * @param root Repository root.
+ */
+void discard_results(const struct benchmark* b, const char* root) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s/%s", root, b->dir, b->results);
+    unlink(path);
+}
+
+/**
+ * Looks up the statistics of a metric in the baseline JSON document.
+ *
+ * @param json Contents of the baseline file.
+ * @param name Name of the metric.
+ * @param base Pointer to the metric receiving the baseline statistics.
+ * @return 0 if the metric was found, -1 otherwise.
+ */
+int find_baseline(const char* json, const char* name, struct metric* base) {
+    char quoted[MAX_NAME + 2];
+    snprintf(quoted, sizeof(quoted), "\"%s\"", name);
+
+    const char* p = strstr(json, quoted);
+    if (p == NULL) return -1;
+    const char* end = strchr(p, '}');
+    if (end == NULL) return -1;
+
+    // Read each field of the metric object
+    const char* fields[] = {"\"median\"", "\"ci_low\"", "\"ci_high\""};
+    double* values[] = {&base->median, &base->ci_low, &base->ci_high};
+    for (int i = 0; i < 3; i++) {
+        const char* f = strstr(p, fields[i]);
+        if (f == NULL || f > end || sscanf(strchr(f, ':') + 1, "%lf", values[i]) != 1) return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Looks up a string field of an object in the baseline JSON document.
+ *
+ * @param json Contents of the baseline file.
+ * @param name Name of the object.
+ * @param field Name of the field.
+ * @param value Buffer receiving the string.
+ * @param size Size of the buffer.
+ * @return 0 if the field was found, -1 otherwise.
+ */
+int find_baseline_string(const char* json, const char* name, const char* field, char* value, size_t size) {
+    char quoted[MAX_NAME + 2];
+    snprintf(quoted, sizeof(quoted), "\"%s\"", name);
+    const char* p = strstr(json, quoted);
+    const char* end = p ? strchr(p, '}') : NULL;
+    if (end == NULL) return -1;
+
+    snprintf(quoted, sizeof(quoted), "\"%s\"", field);
+    const char* f = strstr(p, quoted);
+    const char* start = f && f < end ? strchr(f + strlen(quoted), '"') : NULL;
+    const char* stop = start ? strchr(start + 1, '"') : NULL;
+    if (stop == NULL || stop > end || (size_t)(stop - start - 1) >= size) return -1;
+
+    memcpy(value, start + 1, stop - start - 1);
+    value[stop - start - 1] = '\0';
+    return 0;
+}
+
+/**
+ * Reads the name of the next metric in the baseline JSON document.
+ *
+ * @param json Position in the baseline, advanced past the metric.
+ * @param name Buffer of MAX_NAME bytes receiving the name.
+ * @return 0 if a metric was found, -1 at the end of the document.
+ */
+int next_baseline(const char** json, char* name) {
+    // Each metric is a quoted name followed by its object
+    const char* p = strchr(*json, '"');
+    const char* end = p ? strchr(p + 1, '"') : NULL;
+    const char* object = end ? strchr(end, '{') : NULL;
+    if (object == NULL || end - p - 1 >= MAX_NAME) return -1;
+
+    memcpy(name, p + 1, end - p - 1);
+    name[end - p - 1] = '\0';
+    const char* close = strchr(object, '}');
+    *json = close ? close + 1 : object + 1;
+    return 0;
+}
+
+/**
+ * Reads a whole file into a NUL-terminated buffer.
+ *
+ * @param path Path to the file.
+ * @return Allocated buffer, NULL if the file cannot be read.
+ */
+char* read_file(const char* path) {
+    FILE* f = fopen(path, "r");
+    if (f == NULL) return NULL;
+
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    char* data = malloc(size + 1);
+    if (data && fread(data, 1, size, f) != size) {
+        free(data);
+        data = NULL;
+    }
+    if (data) data[size] = '\0';
+
+    fclose(f);
+    return data;
+}
+
+/**
+ * Reads the name of the host processor, which timings depend on.
+ *
+ * @param host Buffer of MAX_HOST bytes receiving the name, "unknown" if it cannot be read.
+ */
+void read_host(char* host) {
+    char line[256];
+    FILE* f = fopen("/proc/cpuinfo", "r");
+
+    snprintf(host, MAX_HOST, "unknown");
+    while (f && fgets(line, sizeof(line), f)) {
+        char* value = strchr(line, ':');
+        if (strncmp(line, "model name", 10) != 0 || value == NULL) continue;
+        value += strspn(value + 1, " \t") + 1;
+        value[strcspn(value, "\"\n")] = '\0';
+        snprintf(host, MAX_HOST, "%s", value);
+        break;
+    }
+    if (f) fclose(f);
+}
+
+/**
+ * Writes the statistics of all collected timings as the new baseline, with the CPU model of the guests and
+ * the host processor they were measured with.
+ *
+ * @param path Path to the baseline file.
+ * @param model CPU model of the guests.
+ * @param host Name of the host processor.
+ * @return 0 on success, -1 on failure.
+ */
+int write_baseline(const char* path, const char* model, const char* host) {
+    FILE* f = fopen(path, "w");
+    if (f == NULL) {
+        perror("ERROR: Unable to write baseline");
+        return -1;
+    }
+
+    const char* separator = ",";
+    fprintf(f, "{\n  \"cpu\": {\"model\": \"%s\", \"host\": \"%s\"}", model, host);
+    for (int i = 0; i < num_metrics; i++) {
+        if (metrics[i].info) continue;
+        fprintf(f, "%s\n  \"%s\": {\"median\": %.3f, \"ci_low\": %.3f, \"ci_high\": %.3f, \"runs\": %d}", separator,
+                metrics[i].name, metrics[i].median, metrics[i].ci_low, metrics[i].ci_high, metrics[i].count);
+        separator = ",";
+    }
+    fprintf(f, "\n}\n");
+
+    fclose(f);
+    return 0;
+}
+
+/**
+ * Finds the benchmark a metric belongs to, from the prefix of its name.
+ *
+ * @param name Name of the metric.
+ * @return Index of the benchmark, -1 if no benchmark reports the metric.
+ */
+int find_benchmark(const char* name) {
+    for (int i = 0; i < NUM_BENCHMARKS; i++) {
+        size_t len = strlen(benchmarks[i].name);
+        if (strncmp(name, benchmarks[i].name, len) == 0 && name[len] == '.') return i;
+    }
+    return -1;
+}
+
+/**
+ * Looks up a collected metric by its name.
+ *
+ * @param name Name of the metric.
+ * @return Pointer to the metric, NULL if it was not collected.
+ */
+struct metric* find_metric(const char* name) {
+    for (int i = 0; i < num_metrics; i++) {
+        if (strcmp(metrics[i].name, name) == 0) return &metrics[i];
+    }
+    return NULL;
+}
+
+/**
+ * Main function to parse command line arguments, run the selected benchmarks and compare them against the baseline.
+ * A metric regresses when its confidence interval lies entirely above the baseline interval
+ * and its median is slower than the baseline median by more than the tolerance. A metric of the baseline
+ * that a selected benchmark no longer reports fails the comparison as well. Values that are not timings
+ * are shown but never compared. A baseline only applies to the CPU model of the guests it was recorded
+ * with, and its timings are only meaningful on a host like the one it names.
+ *
+ * @param argc Argument count.
+ * @param argv Argument vector.
+ * @return 0 if no metric regressed, 1 on regressions or missing metrics, exits with EXIT_FAILURE on errors.
+ */
+int main(int argc, char* argv[]) {
+    int opt;
+    int runs = 11; // Number of measured runs per benchmark
+    double tolerance = 5.0; // Slowdown in percent ignored even when significant
+    const char* baseline_path = "baseline.json"; // Path to the baseline file
+    const char* root = ".."; // Repository root containing the variants
+    int update = 0; // Write the results as the new baseline instead of comparing
+
+    struct option long_options[] = {
+        {"runs", required_argument, 0, 'n'},
+        {"tolerance", required_argument, 0, 't'},
+        {"baseline", required_argument, 0, 'b'},
+        {"root", required_argument, 0, 'r'},
+        {"update", no_argument, 0, 'u'},
+        {"cpu", required_argument, 0, 'c'},
+        {0, 0, 0, 0,}
+    };
+
+    // Parse the command line options
+    while ((opt = getopt_long(argc, argv, "n:t:b:r:uc:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'n':
+                runs = atoi(optarg);
+                if (runs < 1 || runs > MAX_RUNS) runs = MAX_RUNS;
+                break;
+            case 't':
+                tolerance = atof(optarg);
+                break;
+            case 'b':
+                baseline_path = optarg;
+                break;
+            case 'r':
+                root = optarg;
+                break;
+            case 'u':
+                update = 1;
+                break;
+            case 'c':
+                cpu_model = optarg; // For example scalar on hosts where KVM cannot run SSE
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [--runs <n>] [--tolerance <%%>] [--baseline <file>] [--root <dir>] [--update] [--cpu <model>] [benchmark ...]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    // Run the benchmarks named on the command line, or all of them
+    int selected[NUM_BENCHMARKS];
+    for (int i = 0; i < NUM_BENCHMARKS; i++) {
+        const struct benchmark* b = &benchmarks[i];
+        selected[i] = optind == argc;
+        for (int j = optind; j < argc; j++) {
+            if (strcmp(argv[j], b->name) == 0) selected[i] = 1;
+        }
+        if (!selected[i]) continue;
+
+        if (build_variant(root, b->dir, b->target) < 0) {
+            fprintf(stderr, "ERROR: Unable to build %s\n", b->dir);
+            exit(EXIT_FAILURE);
+        }
+
+        // The first run warms up the page cache and is not measured
+        char name[2 * MAX_NAME];
+        snprintf(name, sizeof(name), "%s.wall_ms", b->name);
+        for (int r = 0; r <= runs; r++) {
+            double elapsed_ms;
+            if (run_once(b, root, &elapsed_ms) < 0) exit(EXIT_FAILURE);
+            if (r == 0) {
+                if (b->results) discard_results(b, root);
+                continue;
+            }
+            add_sample(name, elapsed_ms);
+            if (b->results && collect_results(b, root) <= 0) {
+                fprintf(stderr, "ERROR: Benchmark %s reported no results\n", b->name);
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        // Every run reports every metric, a guest that stopped early misses some
+        for (int m = 0; m < num_metrics; m++) {
+            if (find_benchmark(metrics[m].name) == i && metrics[m].count != runs) {
+                fprintf(stderr, "ERROR: Metric %s reported by %d of %d runs\n", metrics[m].name, metrics[m].count, runs);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    for (int i = 0; i < num_metrics; i++) {
+        compute_stats(&metrics[i]);
+    }
+
+    // Timings depend on the CPU model of the guests and on the host processor
+    const char* model = cpu_model ? cpu_model : "default";
+    char host[MAX_HOST];
+    read_host(host);
+
+    if (update) {
+        if (write_baseline(baseline_path, model, host) < 0) exit(EXIT_FAILURE);
+        printf("Baseline written to %s\n", baseline_path);
+        return 0;
+    }
+
+    char* json = read_file(baseline_path);
+    char base_model[MAX_NAME], base_host[MAX_HOST];
+    if (json == NULL) {
+        fprintf(stderr, "WARNING: No baseline at %s, reporting results only\n", baseline_path);
+    } else if (find_baseline_string(json, "cpu", "model", base_model, sizeof(base_model)) < 0 ||
+               strcmp(base_model, model) != 0) {
+        fprintf(stderr, "ERROR: Baseline %s was not recorded with the %s CPU model\n", baseline_path, model);
+        exit(EXIT_FAILURE);
+    } else if (find_baseline_string(json, "cpu", "host", base_host, sizeof(base_host)) < 0 ||
+               strcmp(base_host, host) != 0) {
+        fprintf(stderr, "WARNING: Baseline %s was recorded on another host, its timings may not compare\n", baseline_path);
+    }
+
+    // Compare every metric against the baseline
+    int regressions = 0;
+    printf("%-36s %12s %27s %12s %9s  %s\n", "metric", "median", "95% CI", "baseline", "change", "verdict");
+    for (int i = 0; i < num_metrics; i++) {
+        struct metric* m = &metrics[i];
+        struct metric base;
+        char ci[64];
+        snprintf(ci, sizeof(ci), "[%.3f, %.3f]", m->ci_low, m->ci_high);
+
+        if (m->info) {
+            printf("%-36s %12.3f %27s %12s %9s  %s\n", m->name, m->median, ci, "-", "-", "info");
+            continue;
+        }
+        if (json == NULL || find_baseline(json, m->name, &base) < 0) {
+            printf("%-36s %12.3f %27s %12s %9s  %s\n", m->name, m->median, ci, "-", "-", "new");
+            continue;
+        }
+
+        double change = 100.0 * (m->median - base.median) / base.median;
+        const char* verdict = "same";
+        if (m->ci_low > base.ci_high && change > tolerance) {
+            verdict = "SLOWER";
+            regressions++;
+        } else if (m->ci_high < base.ci_low && change < -tolerance) {
+            verdict = "faster";
+        }
+
+        printf("%-36s %12.3f %27s %12.3f %+8.1f%%  %s\n", m->name, m->median, ci, base.median, change, verdict);
+    }
+
+    // Report the metrics of the baseline that the selected benchmarks no longer produce
+    int missing = 0;
+    char base_name[MAX_NAME];
+    for (const char* p = json; p && next_baseline(&p, base_name) == 0;) {
+        int b = find_benchmark(base_name);
+        if (b < 0 || !selected[b] || find_metric(base_name)) continue;
+
+        struct metric base;
+        if (find_baseline(json, base_name, &base) < 0) continue;
+        printf("%-36s %12s %27s %12.3f %9s  %s\n", base_name, "-", "-", base.median, "-", "MISSING");
+        missing++;
+    }
+
+    free(json);
+
+    if (regressions) {
+        printf("%d metric(s) regressed\n", regressions);
+    }
+    if (missing) {
+        printf("%d metric(s) missing\n", missing);
+    }
+
+    return regressions || missing ? 1 : 0;
+}
@@ -160,7 +160,7 @@ int create_vcpu(struct guest* vm) {
  */
 int create_kvm_run(struct hypervisor* hypervisor, struct guest* vm) {
     // Map the KVM run structure into the process's address space
-    vm->kvm_run = mmap(NULL, hypervisor->kvm_run_mmap_size, PROT_EXEC | PROT_READ | PROT_WRITE, MAP_SHARED, vm->vm_vcpu, 0);
+    vm->kvm_run = mmap(NULL, hypervisor->kvm_run_mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, vm->vm_vcpu, 0);
     if (vm->kvm_run == MAP_FAILED) {
         // Print an error message if the mmap call fails
         perror("ERROR: Failed to mmap KVM run structure");
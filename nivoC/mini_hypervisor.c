@@ -1,9 +1,12 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <linux/kvm.h>
 #include <string.h>
 #include <errno.h>
@@ -12,14 +15,111 @@
 #include <getopt.h>
 #include <pty.h>
 #include <semaphore.h>
+#include <signal.h>
+#include <time.h>
+#include <elf.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <dirent.h>
+#include <stddef.h>
+#include <linux/fs.h>
 
 // Define constants for file operations
 #define OPEN 1
 #define CLOSE 2
 #define READ 3
 #define WRITE 4
+#define COPY 5
+#define MAP 6
+#define STREAM 7
+#define OPENV 8
+#define STATV 9
+#define READDIR 10
+#define FSYNC 11
+#define PREAD 12
+#define PWRITE 13
+#define LSEEK 14
 #define FINISH 0
 
+// Maximum number of 32-bit arguments of a file operation
+#define FILE_MAX_ARGS 6
+#define FILE_READ_MAX 4096 // Bytes returned by one READ operation
+
+// Define costs and limits of the I/O scheduler
+#define IO_OP_COST 4096 // Cost of a request in bytes, on top of the bytes it moves
+#define IO_BURST_MS 100 // Capacity of the token buckets, in milliseconds of their rate
+#define IO_MAX_CONFIGS 16
+#define COMMIT_SYNCFS_MIN 8 // Distinct files in a batch synced with one syncfs
+#define COMMIT_BATCH_BUCKETS 8 // Buckets of the batch size histogram
+
+// Define thresholds of the access pattern classifier
+#define ACCESS_MIN_RUN 3 // Consecutive requests of a kind before the policy changes
+#define ACCESS_READAHEAD (1 << 20) // Window read ahead of sequential readers
+#define ACCESS_DROP_LAG (1 << 20) // Cached bytes kept behind sequential readers
+#define ACCESS_DROP_CHUNK (1 << 20) // Bytes dropped at once behind sequential readers
+#define ACCESS_PREFETCH_STRIDES 4 // Strides prefetched ahead of strided readers
+#define ACCESS_REPORT_MAX 64
+
+// Define limits of the path cache
+#define PATH_CACHE_SIZE 256
+#define PATH_NEGATIVE_TTL_MS 1000 // Lifetime of the entries of names that do not exist
+
+// Define ports and constants for the block device
+#define BLK_PORT_QUEUE 0x280
+#define BLK_PORT_NOTIFY 0x284
+#define BLK_PORT_CAPACITY 0x288
+#define BLK_QUEUE_MAX 64
+#define BLK_MAX_SEGMENTS 256
+#define BLK_SECTOR_SIZE 512
+#define BLK_T_IN 0
+#define BLK_T_OUT 1
+#define BLK_T_FLUSH 4
+#define BLK_S_OK 0
+#define BLK_S_IOERR 1
+#define BLK_S_UNSUPP 2
+
+// Define ports for the shared memory device
+#define SHM_PORT_ADDR 0x290
+#define SHM_PORT_SIZE 0x294
+#define SHM_PORT_DOORBELL 0x298
+#define SHM_PORT_ID 0x29C
+
+// Port written by the guest to exit
+#define EXIT_PORT 0x2B0
+
+// Port read by the guest for the size of its memory, mapped contiguously from virtual address 0
+#define MEM_PORT_SIZE 0x2B4
+
+// Define ports and limits for streaming reads
+#define STREAM_PORT_RELEASE 0x2C0
+#define STREAM_PORT_WAIT 0x2C4
+#define STREAM_PORT_CLOSE 0x2C8
+#define MAX_STREAMS 4
+#define STREAM_BUFFER_MAX (1 << 20)
+#define STREAM_EMPTY 0
+#define STREAM_FULL 1
+#define STREAM_END 2
+#define STREAM_ERROR 3
+
+// Define ports and limits for the file ring
+#define FILE_RING_PORT_SETUP 0x2D0
+#define FILE_RING_PORT_NOTIFY 0x2D4
+#define FILE_RING_MAX 64
+#define FILE_RING_IO_MAX (1 << 20) // Bytes moved by one read or write request
+#define FILE_WORKERS_MAX 64
+
+// Define the PIC IRQs raised by the devices with --irqchip
+#define CONSOLE_IRQ 4
+#define BLK_IRQ 5
+
+// Define ports and limits for the message device
+#define MSG_PORT_QUEUE 0x2A0
+#define MSG_PORT_NOTIFY 0x2A4
+#define MSG_DATA_MAX 56
+#define MSG_RING_SIZE 64
+#define MSG_MAILBOX_MAX 1024 // Messages waiting in a mailbox before further ones to it are dropped
+
 // Define bitmasks for page directory and table entries
 #define PDE64_PRESENT 1
 #define PDE64_RW (1U << 1)
@@ -27,24 +127,176 @@
 #define PDE64_PS (1U << 7)
 
 #define CR4_PAE (1U << 5)
+#define CR4_OSFXSR (1U << 9)
+#define CR4_OSXMMEXCPT (1U << 10)
+#define CR4_OSXSAVE (1U << 18)
 
 #define CR0_PE 1u
+#define CR0_MP (1U << 1)
+#define CR0_ET (1U << 4)
+#define CR0_NE (1U << 5)
 #define CR0_PG (1U << 31)
 
 #define EFER_LME (1U << 8)
 #define EFER_LMA (1U << 10)
 
 #define SIZE2MB (2 * 1024 * 1024)
+#define PAGE_SIZE 0x1000
+
+// Initial stack pointer of the guest, the stack grows down towards the image
+#define GUEST_STACK_TOP (1 << 21)
+
+// Memory windows (extra memory slots) are mapped with 2MB pages at the same guest virtual and physical
+// addresses in the second gigabyte, through the page directory at WINDOW_PD_ADDR
+#define WINDOW_PD_ADDR 0x3000
+#define WINDOW_BASE 0x40000000ULL
+#define WINDOW_SPACE 0x40000000ULL
+#define MAX_WINDOWS 16
+
+// Mask selecting the physical address bits of a page table entry
+#define PTE_ADDR_MASK 0x000FFFFFFFFFF000ULL
+
+// Limits for the sampling profiler
+#define PROFILE_MAX_DEPTH 64
+#define PROFILE_BUCKETS 4096
+#define PROFILE_TOP 10
+
+// Define the CPUID feature bits of the x86-64 microarchitecture levels, used to mask guests down to a baseline
+#define CPUID_1_EDX_X86_64 0x07FFFBFFU // FPU through SSE2: CMOV, CX8, FXSR, MMX, SSE, SSE2 and the system features
+#define CPUID_1_EDX_SSE ((1U << 25) | (1U << 26)) // SSE, SSE2
+#define CPUID_1_ECX_V2 ((1U << 0) | (1U << 9) | (1U << 13) | (1U << 19) | (1U << 20) | (1U << 23)) // SSE3 to POPCNT
+#define CPUID_1_ECX_V3 (CPUID_1_ECX_V2 | (1U << 12) | (1U << 22) | (1U << 26) | (1U << 28) | (1U << 29)) // AVX, FMA
+#define CPUID_1_ECX_PLATFORM ((1U << 21) | (1U << 24) | (1U << 31)) // x2APIC, TSC deadline, hypervisor
+#define CPUID_7_EBX_V3 ((1U << 3) | (1U << 5) | (1U << 8)) // BMI1, AVX2, BMI2
+#define CPUID_7_EBX_V4 (CPUID_7_EBX_V3 | (1U << 16) | (1U << 17) | (1U << 28) | (1U << 30) | (1U << 31)) // AVX-512
+#define CPUID_81_ECX_V2 (1U << 0) // LAHF in long mode
+#define CPUID_81_ECX_V3 (CPUID_81_ECX_V2 | (1U << 5)) // LZCNT
+#define CPUID_81_EDX_X86_64 ((1U << 11) | (1U << 20) | (1U << 29)) // SYSCALL, NX, long mode
+#define CPUID_81_EDX_PLATFORM ((1U << 26) | (1U << 27)) // 1GB pages, RDTSCP
+
+// Define the CPUID feature bits that need extended state, hidden when XCR0 does not enable it
+#define CPUID_1_ECX_XSAVE (1U << 26)
+#define CPUID_1_EDX_HTT (1U << 28)
+#define CPUID_1_ECX_AVX ((1U << 12) | (1U << 28) | (1U << 29)) // FMA, AVX, F16C
+#define CPUID_7_EBX_AVX (1U << 5) // AVX2
+#define CPUID_7_ECX_AVX ((1U << 9) | (1U << 10)) // VAES, VPCLMULQDQ
+#define CPUID_71_EAX_AVX (1U << 4) // AVX-VNNI
+#define CPUID_7_EBX_AVX512 ((1U << 16) | (1U << 17) | (1U << 21) | (1U << 26) | (1U << 27) | (1U << 28) | \
+                            (1U << 30) | (1U << 31))
+#define CPUID_7_ECX_AVX512 ((1U << 1) | (1U << 6) | (1U << 11) | (1U << 12) | (1U << 14))
+#define CPUID_7_EDX_AVX512 ((1U << 2) | (1U << 3) | (1U << 8) | (1U << 23))
+#define CPUID_71_EAX_AVX512 (1U << 5) // AVX512_BF16
+#define CPUID_7_EDX_AMX ((1U << 22) | (1U << 24) | (1U << 25))
+#define CPUID_D1_EAX_XSAVE 0x7U // XSAVEOPT, XSAVEC and XGETBV with ECX=1, but not XSAVES
+
+// Define the extended state components enabled in XCR0
+#define XCR0_X87 (1ULL << 0)
+#define XCR0_SSE (1ULL << 1)
+#define XCR0_AVX (1ULL << 2)
+#define XCR0_AVX512 (7ULL << 5) // Opmask, upper halves of ZMM0-15 and ZMM16-31
 
 // Enum for page size (2MB or 4KB)
 enum PageSize {MB2, KB4};
 
+// Enum for the CPU models guests can be given: the host CPU, an x86-64 microarchitecture level, or x86-64 with
+// SSE hidden so guests take their scalar code paths
+enum CpuModel {CPU_HOST, CPU_X86_64, CPU_X86_64_V2, CPU_X86_64_V3, CPU_X86_64_V4, CPU_SCALAR, NUM_CPU_MODELS};
+static const char* cpu_model_names[] = {"host", "x86-64", "x86-64-v2", "x86-64-v3", "x86-64-v4", "scalar"};
+
+// Structure representing the CPUID feature bits and extended state allowed by a CPU model
+struct cpu_features {
+    uint32_t leaf1_ecx, leaf1_edx; // Basic features
+    uint32_t leaf7_ebx, leaf7_ecx, leaf7_edx; // Structured extended features
+    uint32_t ext1_ecx, ext1_edx; // Extended features of leaf 0x80000001
+    uint64_t xcr0; // Extended state components
+};
+
+// Features allowed by each CPU model, the host model passes everything KVM supports through
+static const struct cpu_features cpu_models[NUM_CPU_MODELS] = {
+    [CPU_HOST] = {~0U, ~0U, ~0U, ~0U, ~0U, ~0U, ~0U, ~0ULL},
+    [CPU_X86_64] = {CPUID_1_ECX_PLATFORM, CPUID_1_EDX_X86_64, 0, 0, 0,
+                    0, CPUID_81_EDX_X86_64 | CPUID_81_EDX_PLATFORM, XCR0_X87 | XCR0_SSE},
+    [CPU_X86_64_V2] = {CPUID_1_ECX_V2 | CPUID_1_ECX_PLATFORM, CPUID_1_EDX_X86_64, 0, 0, 0,
+                       CPUID_81_ECX_V2, CPUID_81_EDX_X86_64 | CPUID_81_EDX_PLATFORM, XCR0_X87 | XCR0_SSE},
+    [CPU_X86_64_V3] = {CPUID_1_ECX_V3 | CPUID_1_ECX_PLATFORM, CPUID_1_EDX_X86_64, CPUID_7_EBX_V3, 0, 0,
+                       CPUID_81_ECX_V3, CPUID_81_EDX_X86_64 | CPUID_81_EDX_PLATFORM, XCR0_X87 | XCR0_SSE | XCR0_AVX},
+    [CPU_X86_64_V4] = {CPUID_1_ECX_V3 | CPUID_1_ECX_PLATFORM, CPUID_1_EDX_X86_64, CPUID_7_EBX_V4, 0, 0,
+                       CPUID_81_ECX_V3, CPUID_81_EDX_X86_64 | CPUID_81_EDX_PLATFORM,
+                       XCR0_X87 | XCR0_SSE | XCR0_AVX | XCR0_AVX512},
+    [CPU_SCALAR] = {CPUID_1_ECX_PLATFORM, CPUID_1_EDX_X86_64 & ~CPUID_1_EDX_SSE, 0, 0, 0,
+                    0, CPUID_81_EDX_X86_64 | CPUID_81_EDX_PLATFORM, XCR0_X87},
+};
+
 // Structure representing a hypervisor, containing the KVM file descriptor and the KVM run mmap size
 struct hypervisor {
     int kvm_fd; // File descriptor for /dev/kvm
     int kvm_run_mmap_size; // Size of the memory map for the KVM run structure
+    int irqchip; // Nonzero if guests get an in-kernel interrupt controller and timer
+    struct kvm_cpuid2* cpuid; // CPUID leaves supported by KVM on this host
+    enum CpuModel cpu_model; // CPU model given to guests
+    uint64_t xcr0; // Extended state components enabled in guests, 0 without XSAVE
 };
 
+/**
+ * Finds a CPUID leaf in a CPUID table.
+ *
+ * @param cpuid The CPUID table.
+ * @param function Leaf number.
+ * @param index Subleaf number, ignored by leaves without subleaves.
+ * @return Pointer to the entry, NULL if the table has no such leaf.
+ */
+struct kvm_cpuid_entry2* find_cpuid(struct kvm_cpuid2* cpuid, uint32_t function, uint32_t index) {
+    for (uint32_t i = 0; i < cpuid->nent; i++) {
+        struct kvm_cpuid_entry2* entry = &cpuid->entries[i];
+        if (entry->function == function &&
+            (!(entry->flags & KVM_CPUID_FLAG_SIGNIFCANT_INDEX) || entry->index == index)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Gets the CPUID leaves KVM supports and chooses the extended state enabled in guests: x87, SSE and AVX,
+ * and AVX-512 if all of its components are available.
+ *
+ * @param hypervisor Pointer to the hypervisor structure.
+ * @return 0 on success, -1 on failure.
+ */
+int init_cpuid(struct hypervisor* hypervisor) {
+    for (int nent = 64;; nent *= 2) {
+        struct kvm_cpuid2* cpuid = calloc(1, sizeof(struct kvm_cpuid2) + nent * sizeof(struct kvm_cpuid_entry2));
+        if (cpuid == NULL) {
+            perror("ERROR: Failed to allocate CPUID table\n");
+            return -1;
+        }
+        cpuid->nent = nent;
+        if (ioctl(hypervisor->kvm_fd, KVM_GET_SUPPORTED_CPUID, cpuid) == 0) {
+            hypervisor->cpuid = cpuid;
+            break;
+        }
+        free(cpuid);
+        if (errno != E2BIG || nent >= 4096) {
+            perror("ERROR: Failed ioctl KVM_GET_SUPPORTED_CPUID\n");
+            fprintf(stderr, "KVM_GET_SUPPORTED_CPUID: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+
+    struct kvm_cpuid_entry2* features = find_cpuid(hypervisor->cpuid, 1, 0);
+    struct kvm_cpuid_entry2* xstate = find_cpuid(hypervisor->cpuid, 0xD, 0);
+    hypervisor->xcr0 = 0;
+    if (features && xstate && (features->ecx & CPUID_1_ECX_XSAVE) &&
+        ioctl(hypervisor->kvm_fd, KVM_CHECK_EXTENSION, KVM_CAP_XCRS) > 0) {
+        uint64_t supported = xstate->eax | (uint64_t)xstate->edx << 32;
+        hypervisor->xcr0 = supported & (XCR0_X87 | XCR0_SSE | XCR0_AVX);
+        if ((supported & XCR0_AVX512) == XCR0_AVX512 && (hypervisor->xcr0 & XCR0_AVX)) hypervisor->xcr0 |= XCR0_AVX512;
+        if (!(hypervisor->xcr0 & XCR0_SSE)) hypervisor->xcr0 = 0;
+    }
+
+    return 0;
+}
+
 /**
  * Initializes the hypervisor by opening the /dev/kvm file and getting the KVM run mmap size.
  *
@@ -69,9 +321,67 @@ int init_hypervisor(struct hypervisor* hypervisor) {
         return -1;
     }
 
+    // Get the CPU features guests can be given
+    if (init_cpuid(hypervisor) < 0) return -1;
+
     return 0;
 }
 
+// Caching policies chosen from the access pattern of a file
+enum AccessPolicy {ACCESS_NORMAL, ACCESS_SEQUENTIAL, ACCESS_STRIDED, ACCESS_RANDOM, NUM_ACCESS_POLICIES};
+static const char* access_policy_names[] = {"normal", "sequential", "strided", "random"};
+
+// Structure tracking the access pattern of a file
+struct access_pattern {
+    enum AccessPolicy policy; // Policy in effect
+    enum AccessPolicy kind; // Kind of the last request
+    uint32_t run; // Number of consecutive requests of that kind
+    uint64_t requests; // Number of requests recorded
+    off_t last_offset; // Offset of the last request
+    off_t next; // Offset following the last request
+    int64_t stride; // Distance between the last two requests
+    off_t readahead_end; // End of the window read ahead of a sequential reader
+    off_t dropped; // Offset up to which pages behind a sequential reader were dropped
+};
+
+// Final policy of a closed file
+struct access_report {
+    char name[50]; // File name
+    enum AccessPolicy policy; // Policy the file ended up with
+    uint64_t requests; // Number of requests recorded
+};
+
+// Deduplication counters of a guest VM
+struct dedup_stats {
+    uint64_t stored; // Outputs stored as new blobs
+    uint64_t links; // Outputs replaced by a hard link to a blob
+    uint64_t reflinks; // Outputs replaced by a reflink of a blob
+    uint64_t saved_bytes; // Bytes of outputs replaced by blobs
+    uint64_t hashed_bytes; // Bytes hashed
+    uint64_t hash_ns; // Time spent hashing
+    uint64_t unshares; // Linked outputs copied before being written
+};
+
+// Where a file name of a guest resolves to: the guest's own copy, the shared file, or nothing
+enum PathState {PATH_UNKNOWN, PATH_OVERLAY, PATH_SHARED, PATH_MISSING, NUM_PATH_STATES};
+static const char* path_state_names[] = {"unknown", "overlay", "shared", "missing"};
+
+// Entry of the path cache
+struct path_entry {
+    char name[50]; // File name
+    enum PathState state; // Resolution of the name, PATH_UNKNOWN for free entries
+    uint64_t expires_ns; // Time a negative entry expires
+};
+
+// Structure caching the resolution of a guest's file names
+struct path_cache {
+    pthread_mutex_t lock; // Protects the entries and the hit and miss counters
+    struct path_entry entries[PATH_CACHE_SIZE]; // Direct-mapped entries
+    uint64_t hits[NUM_PATH_STATES]; // Lookups answered by the cache, by resolution
+    uint64_t misses; // Lookups of names not cached
+    uint64_t stale; // Cached resolutions found to be out of date
+};
+
 // Structure representing a file used by the guest VM
 struct file {
     int fd; // File descriptor
@@ -80,8 +390,25 @@ struct file {
     int cnt; // Counter for the file name length
     struct file* next; // Pointer to the next file in the list
     char ime[50]; // File name
+    struct access_pattern access; // Access pattern and caching policy
+    int dirty; // Set when the file was written since it was last synced
+    int busy; // Number of requests using the file, it is closed and freed only once none is left
+    pthread_mutex_t access_lock; // Serializes the requests recording their accesses
+};
+
+// Structure representing a memory window mapped into the guest physical address space
+struct window {
+    uint64_t gpa; // Guest physical (and virtual) address of the window
+    uint64_t size; // Size of the window, a multiple of 2MB
+    char* host; // Host mapping backing the window
 };
 
+struct msg_device;
+struct console;
+struct stream;
+struct io_account;
+struct file_queue;
+
 // Structure representing a guest VM
 struct guest {
     int vm_fd; // File descriptor for the VM
@@ -92,11 +419,61 @@ struct guest {
     int id; // ID of the guest VM
     char* mem; // Pointer to the memory allocated for the guest
     struct kvm_run* kvm_run; // Pointer to the KVM run structure
+    pthread_mutex_t files_lock; // Protects the file list and the state of the files, never held across a system call
+    pthread_cond_t files_cond; // Signaled when a request is done with a file
     struct file* file_head; // Head of the file list
     struct file** file_indirect; // Indirect pointer to the file list
-    struct file* current_file; // Pointer to the current file
+    struct file* current_file; // File being opened by the current OPEN operation, not in the file list yet
+    int current_fd; // File descriptor the current operation applies to
+    uint32_t file_args[FILE_MAX_ARGS]; // Arguments of the current file operation
+    int file_nargs; // Number of arguments received for the current file operation
+    uint64_t file_copies; // Number of host-side copies
+    uint64_t file_copy_bytes; // Bytes copied on the host
+    struct io_account* io; // Rate limits and fair share of the host I/O
+    uint64_t access_files[NUM_ACCESS_POLICIES]; // Closed files by the policy they ended up with
+    struct access_report access_reports[ACCESS_REPORT_MAX]; // Closed files that ended up with a policy
+    int num_access_reports; // Number of access reports
+    uint64_t access_readahead_bytes; // Bytes read ahead or prefetched
+    uint64_t access_dropped_bytes; // Cached bytes dropped behind sequential readers
+    struct dedup_stats dedup; // Deduplication of the guest's outputs
+    pthread_mutex_t dedup_lock; // Serializes the deduplication of the guest's outputs and its counters
+    struct path_cache* paths; // Resolution of the guest's file names
+    uint64_t file_batched[3]; // Files opened, files found and directory entries listed by batched operations
+    char read_buf[FILE_READ_MAX]; // Data of the current READ operation
+    uint32_t read_len; // Number of bytes in the read buffer
+    uint32_t read_pos; // Number of bytes of the read buffer sent to the guest
+    char write_buf[FILE_READ_MAX]; // Data of the current WRITE operation not written to the file yet
+    uint32_t write_len; // Number of bytes in the write buffer
+    struct stream* streams[MAX_STREAMS]; // Streaming reads, NULL for free slots
+    uint64_t stream_bytes; // Bytes delivered by closed streams
+    uint64_t stream_fills; // Buffers filled by closed streams
+    uint64_t stream_waits; // Times the guest waited for a buffer of a closed stream
+    struct file_queue* file_queue; // Requests submitted through the file ring
+    size_t mem_size; // Size of the memory allocated for the guest
+    int starting_address; // Guest physical address the image is loaded at
+    pthread_t thread; // Thread running the virtual CPU
+    int running; // Set while the virtual CPU thread is running
+    int failed; // Set when the guest stopped on an error instead of through an exit
+    struct profile* profile; // Samples collected by the profiler, NULL if profiling is disabled
+    size_t image_size; // Size of the loaded guest image
+    struct memory_stats* memory; // Memory accounting, NULL if memory accounting is disabled
+    struct blk_device* blk; // Block device, NULL if no disk image is attached
+    struct window windows[MAX_WINDOWS]; // Memory windows mapped after the guest memory
+    int num_windows; // Number of memory windows
+    uint64_t window_next; // Offset of the next free window address
+    uint64_t doorbells; // Number of doorbells rung for this guest
+    uint64_t doorbells_seen; // Number of doorbells the guest has waited for
+    uint64_t shm_addr; // Guest address of the shared memory window, 0 if not mapped
+    struct msg_device* msg; // Message device
+    struct console* console; // Console receiver, NULL unless the console raises interrupts
+    uint64_t xcr0; // Extended state components enabled in XCR0, 0 without XSAVE
+    int sse; // Set when the CPU model has SSE, CR4.OSFXSR is only set then
 };
 
+// Guest VMs started by the hypervisor
+struct guest** guests;
+int num_guests;
+
 /**
  * Creates a guest VM by issuing an ioctl call to KVM_CREATE_VM.
  *
@@ -153,6 +530,32 @@ int create_memory_region(struct guest* vm, size_t mem_size) {
     return 0;
 }
 
+/**
+ * Creates the in-kernel interrupt controllers (PIC, IOAPIC and a LAPIC per vCPU) and the PIT for the guest VM.
+ * Must be called before the vCPU is created. HLT is then handled in the kernel, the vCPU sleeps until an
+ * interrupt arrives.
+ *
+ * @param vm Pointer to the guest structure.
+ * @return 0 on success, -1 on failure.
+ */
+int create_irqchip(struct guest* vm) {
+    if (ioctl(vm->vm_fd, KVM_CREATE_IRQCHIP, 0) < 0) {
+        perror("ERROR: Failed ioctl KVM_CREATE_IRQCHIP\n");
+        fprintf(stderr, "KVM_CREATE_IRQCHIP: %s\n", strerror(errno));
+        return -1;
+    }
+
+    // The PIT raises IRQ 0, which reaches the vCPU through the PIC and the ExtINT LINT0 of the LAPIC
+    struct kvm_pit_config pit = { .flags = 0 };
+    if (ioctl(vm->vm_fd, KVM_CREATE_PIT2, &pit) < 0) {
+        perror("ERROR: Failed ioctl KVM_CREATE_PIT2\n");
+        fprintf(stderr, "KVM_CREATE_PIT2: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
 /**
  * Creates a virtual CPU (vCPU) for the guest VM by issuing an ioctl call to KVM_CREATE_VCPU.
  *
@@ -181,7 +584,7 @@ int create_vcpu(struct guest* vm) {
  */
 int create_kvm_run(struct hypervisor* hypervisor, struct guest* vm) {
     // Map the KVM run structure into the process's address space
-    vm->kvm_run = mmap(NULL, hypervisor->kvm_run_mmap_size, PROT_EXEC | PROT_READ | PROT_WRITE, MAP_SHARED, vm->vm_vcpu, 0);
+    vm->kvm_run = mmap(NULL, hypervisor->kvm_run_mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, vm->vm_vcpu, 0);
     if (vm->kvm_run == MAP_FAILED) {
         // Print an error message if the mmap call fails
         perror("ERROR: Failed to mmap KVM run structure\n");
@@ -191,6 +594,168 @@ int create_kvm_run(struct hypervisor* hypervisor, struct guest* vm) {
     return 0;
 }
 
+/**
+ * Adjusts the topology leaves of a CPUID entry to describe a single processor with one core and one thread,
+ * since each guest VM has a single vCPU. The cache descriptions are kept as the host reports them.
+ *
+ * @param entry CPUID entry.
+ */
+void set_cpuid_topology(struct kvm_cpuid_entry2* entry) {
+    if (entry->function == 1) {
+        entry->ebx = (entry->ebx & 0x0000FFFF) | (1U << 16); // Initial APIC id 0, one logical processor
+        entry->edx &= ~CPUID_1_EDX_HTT;
+    } else if (entry->function == 4) {
+        entry->eax &= 0x3FFF; // One core per package and one thread per cache
+    } else if (entry->function == 0xB) {
+        // One thread at the SMT level and one core at the core level, x2APIC id 0
+        entry->eax = 0;
+        entry->ebx = entry->index <= 1 ? 1 : 0;
+        entry->ecx = entry->index <= 1 ? ((entry->index + 1) << 8) | entry->index : entry->index;
+        entry->edx = 0;
+    } else if (entry->function == 0x80000008) {
+        entry->ecx &= ~0xFFU; // One core
+    }
+}
+
+/**
+ * Installs the CPUID of the guest VM. Every leaf KVM supports is passed through, including the cache and
+ * topology leaves, then the feature bits are masked to the CPU model given with --cpu. Features whose
+ * extended state is not enabled in XCR0 are hidden, and the extended state leaves only describe the enabled
+ * components. Must be called before the control registers are set, since CR4.OSXSAVE requires XSAVE and
+ * CR4.OSFXSR requires SSE.
+ *
+ * @param hypervisor Pointer to the hypervisor structure.
+ * @param vm Pointer to the guest structure.
+ * @return 0 on success, -1 on failure.
+ */
+int setup_cpuid(struct hypervisor* hypervisor, struct guest* vm) {
+    struct kvm_cpuid2* supported = hypervisor->cpuid;
+    struct kvm_cpuid2* cpuid = calloc(1, sizeof(struct kvm_cpuid2) + (supported->nent + 1) * sizeof(struct kvm_cpuid_entry2));
+    if (cpuid == NULL) {
+        perror("ERROR: Failed to allocate CPUID table\n");
+        return -1;
+    }
+
+    const struct cpu_features* model = &cpu_models[hypervisor->cpu_model];
+    uint64_t xcr0 = hypervisor->xcr0 & model->xcr0;
+    if (!(xcr0 & XCR0_SSE)) xcr0 = 0;
+    uint32_t xsave_size = 576; // Legacy area and header
+    for (uint32_t i = 0; i < supported->nent; i++) {
+        struct kvm_cpuid_entry2 entry = supported->entries[i];
+        set_cpuid_topology(&entry);
+
+        if (entry.function == 1) {
+            entry.ecx &= model->leaf1_ecx;
+            entry.edx &= model->leaf1_edx;
+            if (!xcr0) entry.ecx &= ~CPUID_1_ECX_XSAVE;
+            if (!(xcr0 & XCR0_AVX)) entry.ecx &= ~CPUID_1_ECX_AVX;
+        } else if (entry.function == 7) {
+            if (entry.index == 0) {
+                entry.ebx &= model->leaf7_ebx;
+                entry.ecx &= model->leaf7_ecx;
+                entry.edx &= model->leaf7_edx & ~CPUID_7_EDX_AMX;
+                if (!(xcr0 & XCR0_AVX)) {
+                    entry.ebx &= ~CPUID_7_EBX_AVX;
+                    entry.ecx &= ~CPUID_7_ECX_AVX;
+                }
+                if (!(xcr0 & XCR0_AVX512)) {
+                    entry.ebx &= ~CPUID_7_EBX_AVX512;
+                    entry.ecx &= ~CPUID_7_ECX_AVX512;
+                    entry.edx &= ~CPUID_7_EDX_AVX512;
+                }
+            } else if (hypervisor->cpu_model != CPU_HOST) {
+                entry.eax = entry.ebx = entry.ecx = entry.edx = 0;
+            } else if (entry.index == 1) {
+                if (!(xcr0 & XCR0_AVX)) entry.eax &= ~CPUID_71_EAX_AVX;
+                if (!(xcr0 & XCR0_AVX512)) entry.eax &= ~CPUID_71_EAX_AVX512;
+            }
+        } else if (entry.function == 0xD) {
+            if (!xcr0) {
+                entry.eax = entry.ebx = entry.ecx = entry.edx = 0;
+            } else if (entry.index == 0) {
+                entry.eax = (uint32_t)xcr0;
+                entry.edx = xcr0 >> 32;
+            } else if (entry.index == 1) {
+                entry.eax &= CPUID_D1_EAX_XSAVE;
+                entry.ebx = entry.ecx = entry.edx = 0;
+            } else if (entry.index >= 64 || !(xcr0 & (1ULL << entry.index))) {
+                continue;
+            } else if (entry.ebx + entry.eax > xsave_size) {
+                xsave_size = entry.ebx + entry.eax; // Offset and size of the component
+            }
+        } else if (entry.function == 0x80000001) {
+            entry.ecx &= model->ext1_ecx;
+            entry.edx &= model->ext1_edx;
+        } else if (entry.function == 0xB && entry.index > 0) {
+            continue; // Replaced by the core level below
+        } else if (entry.function == 0x1F) {
+            continue; // Leaf 0xB describes the topology
+        }
+
+        cpuid->entries[cpuid->nent++] = entry;
+    }
+
+    // Describe the core level of the topology after the SMT level
+    struct kvm_cpuid_entry2* smt = find_cpuid(cpuid, 0xB, 0);
+    if (smt) {
+        struct kvm_cpuid_entry2 core = *smt;
+        core.index = 1;
+        set_cpuid_topology(&core);
+        cpuid->entries[cpuid->nent++] = core;
+    }
+
+    // The largest save area covers the enabled components
+    struct kvm_cpuid_entry2* xstate = find_cpuid(cpuid, 0xD, 0);
+    if (xstate && xcr0) xstate->ecx = xsave_size;
+
+    if (ioctl(vm->vm_vcpu, KVM_SET_CPUID2, cpuid) < 0) {
+        perror("ERROR: Failed ioctl KVM_SET_CPUID2\n");
+        fprintf(stderr, "KVM_SET_CPUID2: %s\n", strerror(errno));
+        free(cpuid);
+        return -1;
+    }
+    free(cpuid);
+
+    vm->xcr0 = xcr0;
+    vm->sse = (model->leaf1_edx & CPUID_1_EDX_SSE) != 0;
+    return 0;
+}
+
+/**
+ * Initializes the FPU and SSE state of the guest VM and enables the extended state components in XCR0,
+ * so the guest can run x87, SSE and AVX code from its first instruction.
+ *
+ * @param vm Pointer to the guest structure.
+ * @return 0 on success, -1 on failure.
+ */
+int setup_fpu(struct guest* vm) {
+    struct kvm_fpu fpu;
+    memset(&fpu, 0, sizeof(fpu));
+    fpu.fcw = 0x37F; // All x87 exceptions masked, double extended precision
+    fpu.mxcsr = 0x1F80; // All SSE exceptions masked, round to nearest
+
+    if (ioctl(vm->vm_vcpu, KVM_SET_FPU, &fpu) < 0) {
+        perror("ERROR: Failed ioctl KVM_SET_FPU\n");
+        fprintf(stderr, "KVM_SET_FPU: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (vm->xcr0 == 0) return 0;
+
+    struct kvm_xcrs xcrs;
+    memset(&xcrs, 0, sizeof(xcrs));
+    xcrs.nr_xcrs = 1;
+    xcrs.xcrs[0].xcr = 0;
+    xcrs.xcrs[0].value = vm->xcr0;
+    if (ioctl(vm->vm_vcpu, KVM_SET_XCRS, &xcrs) < 0) {
+        perror("ERROR: Failed ioctl KVM_SET_XCRS\n");
+        fprintf(stderr, "KVM_SET_XCRS: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
 /**
  * Sets up a 64-bit code segment for the guest VM by configuring the segment descriptor.
  *
@@ -244,12 +809,14 @@ int setup_long_mode(struct guest* vm, size_t mem_size, enum PageSize page_size)
     uint64_t pd_addr = 0x2000; // Address of the page directory
     uint64_t* pd = (void*)(vm->mem + pd_addr); // Pointer to the page directory
 
-    uint64_t page = 0x3000; // Initial page address
+    uint64_t page = WINDOW_PD_ADDR + 0x1000; // Initial page address
 
     // Set up the PML4 entry
     pml4[0] = PDE64_PRESENT | PDE64_RW | PDE64_USER | pdpt_addr;
     // Set up the PDPT entry
     pdpt[0] = PDE64_PRESENT | PDE64_RW | PDE64_USER | pd_addr;
+    // Set up the PDPT entry for the memory windows, its page directory is filled by map_window
+    pdpt[WINDOW_BASE >> 30] = PDE64_PRESENT | PDE64_RW | PDE64_USER | WINDOW_PD_ADDR;
 
     if (page_size == MB2) {
         // Align the page address to 2MB
@@ -284,7 +851,10 @@ int setup_long_mode(struct guest* vm, size_t mem_size, enum PageSize page_size)
     // Set the special registers
     sregs.cr3 = pml4_addr; // Set the CR3 register to the address of the PML4
     sregs.cr4 = CR4_PAE; // Enable PAE
-    sregs.cr0 = CR0_PE | CR0_PG; // Enable protected mode and paging
+    // Enable FXSAVE and SSE exceptions, guests check CR4 as well as CPUID before they use SSE
+    if (vm->sse) sregs.cr4 |= CR4_OSFXSR | CR4_OSXMMEXCPT;
+    if (vm->xcr0) sregs.cr4 |= CR4_OSXSAVE; // Enable XSAVE and the AVX state
+    sregs.cr0 = CR0_PE | CR0_MP | CR0_ET | CR0_NE | CR0_PG; // Enable protected mode, paging and native FPU errors
     sregs.efer = EFER_LMA | EFER_LME; // Enable long mode
 
     // Set up the 64-bit code segment
@@ -323,7 +893,7 @@ int setup_registers(struct guest* vm) {
 
     regs.rflags = 2; // Set the RFLAGS register
     regs.rip = 0; // Set the instruction pointer to 0
-    regs.rsp = 1 << 21; // Set the stack pointer
+    regs.rsp = GUEST_STACK_TOP - 8; // Set the stack pointer as if the entry point had been called
 
     // Set the general-purpose registers for the virtual CPU
     if (ioctl(vm->vm_vcpu, KVM_SET_REGS, &regs) < 0) {
@@ -337,366 +907,4762 @@ int setup_registers(struct guest* vm) {
 }
 
 /**
- * Sets up a pseudoterminal for the guest VM.
+ * Translates a guest physical address range to a pointer into the memory mapped for the guest.
  *
  * @param vm Pointer to the guest structure.
- * @return 0 on success, -1 on failure.
+ * @param gpa Guest physical address.
+ * @param len Length of the range in bytes.
+ * @return Host pointer on success, NULL if the range is not backed by guest memory.
  */
-int setup_terminal(struct guest* vm) {
-    // Open a pseudoterminal
-    if (openpty(&vm->pty_master, &vm->pty_slave, NULL, NULL, NULL) != 0) {
-        // Print an error message if the pseudoterminal cannot be opened
-        perror("ERROR: Failed to open pseudoterminal\n");
-        fprintf(stderr, "openpty: %s\n", strerror(errno));
-        return -1;
+void* guest_phys_to_host(struct guest* vm, uint64_t gpa, size_t len) {
+    if (gpa < vm->mem_size) {
+        if (len > vm->mem_size - gpa) return NULL;
+        return vm->mem + gpa;
     }
 
-    return 0;
+    // Look for the memory window containing the range
+    for (int i = 0; i < vm->num_windows; i++) {
+        struct window* w = &vm->windows[i];
+        if (gpa >= w->gpa && gpa - w->gpa < w->size) {
+            if (len > w->size - (gpa - w->gpa)) return NULL;
+            return w->host + (gpa - w->gpa);
+        }
+    }
+
+    return NULL;
 }
 
 /**
- * Handles the HALT exit reason by printing a message.
+ * Maps host memory into the guest as a new memory slot and makes it accessible through the guest page tables.
  *
  * @param vm Pointer to the guest structure.
- * @return 1 to indicate the VM should stop running.
+ * @param host Host mapping backing the window.
+ * @param size Size of the window, a multiple of 2MB.
+ * @param writable Nonzero if the guest may write to the window.
+ * @return Guest address of the window on success, 0 on failure.
  */
-int exit_halt(struct guest* vm) {
-    printf("KVM_EXIT_HLT\n");
-    return 1;
-}
+uint64_t map_window(struct guest* vm, char* host, uint64_t size, int writable) {
+    struct kvm_userspace_memory_region region;
 
-// Semaphore for synchronizing file operations
-sem_t file_mutex;
+    if (vm->mem_size > WINDOW_BASE || vm->num_windows == MAX_WINDOWS || size % SIZE2MB != 0 || size > WINDOW_SPACE - vm->window_next) {
+        fprintf(stderr, "VM %d: no room for a %" PRIu64 " KB memory window\n", vm->id, size / 1024);
+        return 0;
+    }
 
-/**
- * Initializes a new file structure and returns a pointer to it.
- *
- * @return Pointer to the newly allocated file structure.
- */
-struct file* init_file() {
-    // Allocate memory for a new file structure
-    struct file* new_file = (struct file*)malloc(sizeof(struct file));
-    if (new_file == NULL) {
-        // Print an error message if memory allocation fails
-        perror("ERROR: Failed to allocate new file\n");
-        exit(EXIT_FAILURE);
+    uint64_t gpa = WINDOW_BASE + vm->window_next;
+
+    // Set up the memory region structure, slot 0 is the guest memory
+    region.slot = vm->num_windows + 1;
+    region.flags = writable ? 0 : KVM_MEM_READONLY;
+    region.guest_phys_addr = gpa;
+    region.memory_size = size;
+    region.userspace_addr = (unsigned long)host;
+
+    if (ioctl(vm->vm_fd, KVM_SET_USER_MEMORY_REGION, &region) < 0) {
+        perror("ERROR: Failed ioctl KVM_SET_USER_MEMORY_REGION\n");
+        fprintf(stderr, "KVM_SET_USER_MEMORY_REGION: %s\n", strerror(errno));
+        return 0;
     }
 
-    // Initialize the file structure fields
-    new_file->cnt = 0;
-    new_file->next = NULL;
-    new_file->flags = -1;
-    new_file->mode = -1;
-    new_file->fd = -1;
+    // Map the window with 2MB pages at the same virtual address
+    uint64_t* pd = (void*)(vm->mem + WINDOW_PD_ADDR);
+    for (uint64_t offset = 0; offset < size; offset += SIZE2MB) {
+        pd[(gpa - WINDOW_BASE + offset) / SIZE2MB] = PDE64_PRESENT | PDE64_USER | PDE64_PS | (writable ? PDE64_RW : 0) | (gpa + offset);
+    }
 
-    return new_file;
+    struct window* w = &vm->windows[vm->num_windows++];
+    w->gpa = gpa;
+    w->size = size;
+    w->host = host;
+    vm->window_next += size;
+
+    return gpa;
 }
 
 /**
- * Starts a file operation (open, close, read, write) by setting the appropriate lock and initializing the file structure if needed.
+ * Translates a guest virtual address by walking the page tables built by setup_long_mode.
  *
  * @param vm Pointer to the guest structure.
- * @param operation The file operation to start (OPEN, CLOSE, READ, WRITE).
- * @return 0 on success.
+ * @param gva Guest virtual address.
+ * @return Guest physical address on success, -1 if the address is not mapped.
  */
-int start_file_operation(struct guest* vm, int operation) {
-    // Lock the semaphore to synchronize file operations
-    sem_wait(&file_mutex);
-    vm->lock = operation;
+int64_t guest_virt_to_phys(struct guest* vm, uint64_t gva) {
+    static const int shifts[] = {39, 30, 21, 12}; // Index shift for the PML4, PDPT, PD and PT
+    uint64_t table = 0; // CR3 points to the PML4 at guest physical address 0
 
-    if (operation == OPEN) {
-        // Initialize a new file structure if the operation is OPEN
-        struct file* new_file = init_file();
-        *vm->file_indirect = new_file;
-        vm->file_indirect = &new_file->next;
-        vm->current_file = new_file;
+    for (int level = 0; level < 4; level++) {
+        uint64_t* entries = guest_phys_to_host(vm, table, 0x1000);
+        if (entries == NULL) return -1;
+
+        uint64_t entry = entries[(gva >> shifts[level]) & 0x1FF];
+        if (!(entry & PDE64_PRESENT)) return -1;
+
+        // A PTE or a large page entry terminates the walk
+        if (level == 3 || (level > 0 && (entry & PDE64_PS))) {
+            uint64_t offset_mask = (1ULL << shifts[level]) - 1;
+            return (entry & PTE_ADDR_MASK & ~offset_mask) | (gva & offset_mask);
+        }
+        table = entry & PTE_ADDR_MASK;
     }
 
-    return 0;
+    return -1;
 }
 
 /**
- * Ends a file operation by unlocking the semaphore and resetting the lock and current file pointer.
+ * Reads an aligned 64-bit value from guest virtual memory.
  *
  * @param vm Pointer to the guest structure.
- * @return 0 on success.
+ * @param gva Guest virtual address of the value.
+ * @param value Pointer where the value is stored.
+ * @return 0 on success, -1 if the address is unaligned or not mapped.
  */
-int end_file_operation(struct guest* vm) {
-    // Unlock the semaphore to allow other file operations
-    sem_post(&file_mutex);
-    vm->lock = 0;
-    vm->current_file = NULL;
+int read_guest_u64(struct guest* vm, uint64_t gva, uint64_t* value) {
+    if (gva & 7) return -1;
+
+    int64_t gpa = guest_virt_to_phys(vm, gva);
+    if (gpa < 0) return -1;
+
+    uint64_t* p = guest_phys_to_host(vm, gpa, sizeof(uint64_t));
+    if (p == NULL) return -1;
+
+    *value = *p;
     return 0;
 }
 
 /**
- * Checks if the file path exists and opens it if it does.
+ * Copies data between host memory and guest virtual memory, translating the guest address page by page.
  *
  * @param vm Pointer to the guest structure.
- * @return File descriptor of the opened file, -1 if the file does not exist.
+ * @param gva Guest virtual address.
+ * @param buf Host buffer.
+ * @param len Number of bytes to copy.
+ * @param to_guest Nonzero to copy from the host buffer to the guest, zero for the other direction.
+ * @return 0 on success, -1 if part of the guest range is not mapped.
  */
-int check_path_exists(struct guest* vm) {
-    char path[200];
-    // Construct the file path using the VM ID and file name
-    sprintf(path, "vm_%d_", vm->id);
-    strcat(path, vm->current_file->ime);
-    // Check if the file exists and open it
-    if (access(path, F_OK) == 0) {
-        return open(path, vm->current_file->flags, vm->current_file->mode);
-    } else {
-        return -1;
+int copy_guest(struct guest* vm, uint64_t gva, void* buf, size_t len, int to_guest) {
+    char* p = buf;
+
+    while (len > 0) {
+        size_t chunk = PAGE_SIZE - (gva & (PAGE_SIZE - 1));
+        if (chunk > len) chunk = len;
+
+        int64_t gpa = guest_virt_to_phys(vm, gva);
+        char* host = gpa < 0 ? NULL : guest_phys_to_host(vm, gpa, chunk);
+        if (host == NULL) return -1;
+
+        if (to_guest) memcpy(host, p, chunk);
+        else memcpy(p, host, chunk);
+
+        gva += chunk;
+        p += chunk;
+        len -= chunk;
     }
+
+    return 0;
 }
 
 /**
- * Creates a local copy of the file for the guest VM.
+ * Reads a NUL-terminated string from guest virtual memory.
  *
  * @param vm Pointer to the guest structure.
+ * @param gva Guest virtual address of the string.
+ * @param buf Buffer receiving the string.
+ * @param max Size of the buffer.
+ * @return Length of the string, -1 if it is not mapped or does not fit.
  */
-void create_local_copy(struct guest* vm) {
-    char path[200];
-    // Construct the file path using the VM ID and file name
-    sprintf(path, "vm_%d_", vm->id);
-    strcat(path, vm->current_file->ime);
-    // Create the local copy of the file
-    open(path, O_CREAT, 0777);
+int read_guest_string(struct guest* vm, uint64_t gva, char* buf, size_t max) {
+    size_t len = 0;
+
+    while (len < max) {
+        size_t chunk = PAGE_SIZE - ((gva + len) & (PAGE_SIZE - 1));
+        if (chunk > max - len) chunk = max - len;
+
+        int64_t gpa = guest_virt_to_phys(vm, gva + len);
+        char* host = gpa < 0 ? NULL : guest_phys_to_host(vm, gpa, chunk);
+        if (host == NULL) return -1;
+
+        // Copy up to and including the terminator
+        char* end = memchr(host, '\0', chunk);
+        size_t n = end ? (size_t)(end - host) + 1 : chunk;
+        memcpy(buf + len, host, n);
+        len += n;
+        if (end) return len - 1;
+    }
+
+    return -1;
 }
 
 /**
- * Handles setting the flags and mode for an opened file operation.
+ * Sets up a pseudoterminal for the guest VM.
  *
  * @param vm Pointer to the guest structure.
- * @param data Flags or mode for the file operation.
- * @return 0 on success.
+ * @return 0 on success, -1 on failure.
  */
-int opened_file_op_flags(struct guest* vm, int data) {
-    if (vm->current_file->flags == -1) {
-        // Set the flags if they are not already set
-        vm->current_file->flags = data;
-    } else {
-        // Set the mode and open the file if the flags are already set
-        vm->current_file->mode = data;
-        int local_fd = check_path_exists(vm);
-
-        if (local_fd < 0) {
-            // If the file does not exist, create a local copy if needed
-            if (vm->current_file->flags & (O_RDWR | O_WRONLY | O_TRUNC | O_APPEND)) {
-                create_local_copy(vm);
-                vm->current_file->fd = check_path_exists(vm);
-            } else {
-                // Open the file with the specified flags and mode
-                vm->current_file->fd = open(vm->current_file->ime, vm->current_file->flags, vm->current_file->mode);
-            }
-        } else {
-            // Use the existing file descriptor if the file exists
-            vm->current_file->fd = local_fd;
-        }
+int setup_terminal(struct guest* vm) {
+    struct termios attributes;
+
+    // Raw mode, so the terminal neither echoes guest output back nor buffers lines
+    memset(&attributes, 0, sizeof(attributes));
+    cfmakeraw(&attributes);
+
+    // Open a pseudoterminal
+    if (openpty(&vm->pty_master, &vm->pty_slave, NULL, &attributes, NULL) != 0) {
+        // Print an error message if the pseudoterminal cannot be opened
+        perror("ERROR: Failed to open pseudoterminal\n");
+        fprintf(stderr, "openpty: %s\n", strerror(errno));
+        return -1;
     }
 
+    printf("VM %d console: %s\n", vm->id, ttyname(vm->pty_slave));
     return 0;
 }
 
 /**
- * Sends the file descriptor of the currently opened file to the guest VM.
+ * Handles the HALT exit reason by printing a message.
  *
  * @param vm Pointer to the guest structure.
- * @return 0 on success.
+ * @return 1 to indicate the VM should stop running.
  */
-int opened_file_op_send_fd(struct guest* vm) {
-    *((int*)((char*)vm->kvm_run + vm->kvm_run->io.data_offset)) = vm->current_file->fd;
-    return end_file_operation(vm);
+int exit_halt(struct guest* vm) {
+    printf("KVM_EXIT_HLT\n");
+    return 1;
 }
 
 /**
- * Handles setting the name for an opened file operation.
+ * Returns the current time of the monotonic clock.
  *
- * @param vm Pointer to the guest structure.
- * @param data Character data for the file name.
- * @return 0 on success.
+ * @return Time in nanoseconds.
  */
-int opened_file_op_name(struct guest* vm, char data) {
-    vm->current_file->ime[vm->current_file->cnt++] = data;
-    return 0;
+uint64_t monotonic_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
 }
 
-/**
- * Retrieves the file descriptor for a given file and sets it as the current file.
- *
- * @param vm Pointer to the guest structure.
- * @param data File descriptor.
- * @return 0 on success.
- */
-int get_file_descriptor(struct guest* vm, int data) {
-    // Iterate through the file list to find the file with the specified file descriptor
-    for (struct file* current = vm->file_head; current; current = current->next) {
-        if (current->fd == data) {
-            vm->current_file = current;
-            break;
-        }
-    }
+// Token bucket limiting a rate, it may go into debt by the cost of the last request
+struct token_bucket {
+    uint64_t rate; // Tokens added per second, 0 for no limit
+    double tokens; // Tokens available, negative while in debt
+    uint64_t last_ns; // Time of the last refill
+};
+
+// Options configuring the host I/O of the guests
+enum IoConfigKind {IO_CONFIG_LIMIT, IO_CONFIG_WEIGHT, IO_CONFIG_DURABILITY};
+
+// When data written by a guest is synced to stable storage: never, when a file is closed or flushed, or only
+// when the guest flushes a file or its disk
+enum Durability {DURABILITY_NONE, DURABILITY_CLOSE, DURABILITY_FLUSH, NUM_DURABILITY_MODES};
+static const char* durability_names[] = {"none", "close", "flush"};
+
+// Setting of the guests selected by an --io-limit, --io-weight or --durability option
+struct io_config {
+    int id; // ID of the guest VM, -1 for all guests
+    enum IoConfigKind kind; // Setting changed by the option
+    uint64_t bytes_per_s; // Byte rate, 0 for no limit
+    uint64_t ops_per_s; // Operation rate, 0 for no limit
+    uint32_t weight; // Share of the host I/O relative to other guests
+    enum Durability durability; // Durability mode
+};
+
+struct io_config io_configs[IO_MAX_CONFIGS];
+int num_io_configs;
+
+// Structure accounting the host I/O of a guest VM, shared by its vCPU and device threads
+struct io_account {
+    pthread_mutex_t lock; // Protects the buckets and counters
+    struct token_bucket bytes; // Bytes moved by file and block requests
+    struct token_bucket ops; // File operations and block requests
+    uint32_t weight; // Share of the host I/O relative to other guests
+    enum Durability durability; // When the guest's writes are synced
+    uint64_t start_tag; // Virtual start time of the last request started, protected by the scheduler lock
+    uint64_t finish; // Virtual finish time of the last request, protected by the scheduler lock
+    uint64_t requests; // Number of requests served
+    uint64_t bytes_total; // Number of bytes moved
+    uint64_t throttled; // Number of requests delayed by the token buckets
+    uint64_t throttled_ns; // Time spent waiting for tokens
+    uint64_t queued_ns; // Time spent waiting for other guests' requests
+    uint64_t commits; // Number of syncs requested, protected by the group commit lock
+    uint64_t commit_ns; // Time spent waiting for syncs, protected by the group commit lock
+    uint64_t max_commit_ns; // Longest wait for a sync, protected by the group commit lock
+};
+
+// Request waiting for the host I/O
+struct io_waiter {
+    uint64_t tag; // Virtual start time, requests are served in increasing order
+    struct io_waiter* next; // Next waiting request
+};
+
+// Weighted fair queuing of the requests of all guest VMs. Up to slots requests use the host I/O at once, and
+// each guest's virtual time advances by the cost of its requests divided by its weight.
+struct io_scheduler {
+    pthread_mutex_t lock; // Protects the scheduler and the virtual finish times
+    pthread_cond_t cond; // Signaled when the host I/O is released
+    int busy; // Number of requests being served
+    int slots; // Number of requests served at once
+    uint64_t virtual_time; // Virtual start time of the last request started
+    struct io_waiter* waiters; // Requests waiting, in arrival order
+};
+
+struct io_scheduler io_scheduler = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 1, 0, NULL };
+
+/**
+ * Parses an --io-limit ([id=]bytes_per_s/ops_per_s), --io-weight ([id=]weight) or --durability
+ * ([id=]none|close|flush) option. Without an id the option applies to all guests, options given later
+ * override earlier ones.
+ *
+ * @param arg The option argument.
+ * @param kind The setting the option changes.
+ * @return 0 on success, -1 if the argument is invalid.
+ */
+int parse_io_config(const char* arg, enum IoConfigKind kind) {
+    struct io_config config = { .id = -1, .kind = kind };
+    const char* value = strchr(arg, '=');
+
+    if (value) {
+        config.id = atoi(arg);
+        value++;
+    } else {
+        value = arg;
+    }
+
+    if (kind == IO_CONFIG_WEIGHT) {
+        if (sscanf(value, "%u", &config.weight) != 1 || config.weight == 0) return -1;
+    } else if (kind == IO_CONFIG_LIMIT) {
+        if (sscanf(value, "%" SCNu64 "/%" SCNu64, &config.bytes_per_s, &config.ops_per_s) != 2) return -1;
+    } else {
+        config.durability = NUM_DURABILITY_MODES;
+        for (int i = 0; i < NUM_DURABILITY_MODES; i++) {
+            if (strcmp(value, durability_names[i]) == 0) config.durability = i;
+        }
+        if (config.durability == NUM_DURABILITY_MODES) return -1;
+    }
+
+    if (num_io_configs == IO_MAX_CONFIGS) return -1;
+    io_configs[num_io_configs++] = config;
+    return 0;
+}
+
+/**
+ * Initializes the I/O accounting of a guest VM from the --io-limit, --io-weight and --durability options.
+ * Guests sync when they flush unless told otherwise.
+ *
+ * @param vm Pointer to the guest structure.
+ * @return 0 on success, -1 on failure.
+ */
+int init_io_account(struct guest* vm) {
+    struct io_account* io = calloc(1, sizeof(struct io_account));
+    if (io == NULL) {
+        perror("ERROR: Failed to allocate I/O accounting\n");
+        return -1;
+    }
+
+    pthread_mutex_init(&io->lock, NULL);
+    io->weight = 1;
+    io->durability = DURABILITY_FLUSH;
+    for (int i = 0; i < num_io_configs; i++) {
+        if (io_configs[i].id != -1 && io_configs[i].id != vm->id) continue;
+        if (io_configs[i].kind == IO_CONFIG_LIMIT) {
+            io->bytes.rate = io_configs[i].bytes_per_s;
+            io->ops.rate = io_configs[i].ops_per_s;
+        } else if (io_configs[i].kind == IO_CONFIG_WEIGHT) {
+            io->weight = io_configs[i].weight;
+        } else {
+            io->durability = io_configs[i].durability;
+        }
+    }
+
+    // Buckets start full
+    io->bytes.tokens = io->bytes.rate * IO_BURST_MS / 1000.0;
+    io->ops.tokens = io->ops.rate * IO_BURST_MS / 1000.0;
+    io->bytes.last_ns = io->ops.last_ns = monotonic_ns();
+
+    vm->io = io;
+    return 0;
+}
+
+/**
+ * Refills a token bucket and returns how long a request must wait until it is out of debt.
+ *
+ * @param bucket Pointer to the bucket.
+ * @param now Current time in nanoseconds.
+ * @return Time to wait in nanoseconds, 0 if the request may proceed.
+ */
+uint64_t bucket_delay(struct token_bucket* bucket, uint64_t now) {
+    if (bucket->rate == 0) return 0;
+
+    double capacity = bucket->rate * IO_BURST_MS / 1000.0;
+    bucket->tokens += (double)bucket->rate * (now - bucket->last_ns) / 1e9;
+    if (bucket->tokens > capacity) bucket->tokens = capacity;
+    bucket->last_ns = now;
+
+    return bucket->tokens >= 0 ? 0 : (uint64_t)(-bucket->tokens * 1e9 / bucket->rate) + 1;
+}
+
+/**
+ * Delays a request of a guest VM until its token buckets are out of debt. Requests are throttled before
+ * they take any lock or pin any file, so a throttled request holds nothing while it sleeps.
+ *
+ * @param vm Pointer to the guest structure.
+ */
+void io_throttle(struct guest* vm) {
+    struct io_account* io = vm->io;
+    if (io->bytes.rate == 0 && io->ops.rate == 0) return;
+
+    for (int waited = 0;; waited = 1) {
+        pthread_mutex_lock(&io->lock);
+        uint64_t now = monotonic_ns();
+        uint64_t delay = bucket_delay(&io->bytes, now);
+        uint64_t ops_delay = bucket_delay(&io->ops, now);
+        if (ops_delay > delay) delay = ops_delay;
+        if (delay > 0) {
+            io->throttled += !waited;
+            io->throttled_ns += delay;
+        }
+        pthread_mutex_unlock(&io->lock);
+        if (delay == 0) return;
+
+        struct timespec ts = { delay / 1000000000ULL, delay % 1000000000ULL };
+        nanosleep(&ts, NULL);
+    }
+}
+
+/**
+ * Waits for the turn of a guest VM to use the host I/O, once the request was throttled by io_throttle.
+ * Requests of all guests are served in order of their virtual start time, so each guest gets a share
+ * proportional to its weight while it has requests pending.
+ *
+ * @param vm Pointer to the guest structure.
+ */
+void io_acquire(struct guest* vm) {
+    uint64_t start = monotonic_ns();
+    struct io_waiter waiter = { .next = NULL };
+
+    pthread_mutex_lock(&io_scheduler.lock);
+    waiter.tag = vm->io->finish > io_scheduler.virtual_time ? vm->io->finish : io_scheduler.virtual_time;
+    struct io_waiter** indirect = &io_scheduler.waiters;
+    while (*indirect) indirect = &(*indirect)->next;
+    *indirect = &waiter;
+
+    for (;;) {
+        // The first waiter with the smallest tag goes next
+        struct io_waiter* next = io_scheduler.waiters;
+        for (struct io_waiter* current = next; current; current = current->next) {
+            if (current->tag < next->tag) next = current;
+        }
+        if (io_scheduler.busy < io_scheduler.slots && next == &waiter) break;
+        pthread_cond_wait(&io_scheduler.cond, &io_scheduler.lock);
+    }
+
+    for (indirect = &io_scheduler.waiters; *indirect != &waiter; indirect = &(*indirect)->next);
+    *indirect = waiter.next;
+    io_scheduler.busy++;
+    io_scheduler.virtual_time = waiter.tag;
+    vm->io->start_tag = waiter.tag;
+    pthread_mutex_unlock(&io_scheduler.lock);
+
+    pthread_mutex_lock(&vm->io->lock);
+    vm->io->queued_ns += monotonic_ns() - start;
+    pthread_mutex_unlock(&vm->io->lock);
+}
+
+/**
+ * Releases the host I/O after a request and charges its cost to the guest VM. The cost is added to the
+ * guest's own start tag, the scheduler's virtual time may already belong to another guest's request.
+ * Requests of the guest served at once add up their costs.
+ *
+ * @param vm Pointer to the guest structure.
+ * @param bytes Number of bytes the request moved.
+ */
+void io_release(struct guest* vm, uint64_t bytes) {
+    struct io_account* io = vm->io;
+
+    pthread_mutex_lock(&io_scheduler.lock);
+    uint64_t start_tag = io->finish > io->start_tag ? io->finish : io->start_tag;
+    io->finish = start_tag + (IO_OP_COST + bytes) / io->weight;
+    io_scheduler.busy--;
+    pthread_cond_broadcast(&io_scheduler.cond);
+    pthread_mutex_unlock(&io_scheduler.lock);
+
+    pthread_mutex_lock(&io->lock);
+    io->bytes.tokens -= bytes;
+    io->ops.tokens -= 1;
+    io->requests++;
+    io->bytes_total += bytes;
+    pthread_mutex_unlock(&io->lock);
+}
+
+/**
+ * Initializes a new file structure and returns a pointer to it.
+ *
+ * @return Pointer to the newly allocated file structure.
+ */
+struct file* init_file() {
+    // Allocate memory for a new file structure
+    struct file* new_file = (struct file*)malloc(sizeof(struct file));
+    if (new_file == NULL) {
+        // Print an error message if memory allocation fails
+        perror("ERROR: Failed to allocate new file\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Initialize the file structure fields
+    new_file->cnt = 0;
+    new_file->next = NULL;
+    new_file->flags = -1;
+    new_file->mode = -1;
+    new_file->fd = -1;
+    memset(&new_file->access, 0, sizeof(new_file->access));
+    new_file->dirty = 0;
+    new_file->busy = 0;
+    pthread_mutex_init(&new_file->access_lock, NULL);
+
+    return new_file;
+}
+
+/**
+ * Frees a file structure.
+ *
+ * @param file The file to free, NULL to do nothing.
+ */
+void free_file(struct file* file) {
+    if (file == NULL) return;
+    pthread_mutex_destroy(&file->access_lock);
+    free(file);
+}
+
+/**
+ * Appends a file structure to the file list of the guest VM.
+ *
+ * @param vm Pointer to the guest structure.
+ * @param file The file to append.
+ */
+void link_file(struct guest* vm, struct file* file) {
+    *vm->file_indirect = file;
+    vm->file_indirect = &file->next;
+}
+
+/**
+ * Adds a new file structure to the file list of the guest VM.
+ *
+ * @param vm Pointer to the guest structure.
+ * @return Pointer to the new file structure.
+ */
+struct file* add_file(struct guest* vm) {
+    struct file* new_file = init_file();
+    link_file(vm, new_file);
+    return new_file;
+}
+
+/**
+ * Starts a file operation (open, close, read, write) by setting the appropriate lock and initializing the file structure if needed.
+ * The host I/O is only used while the operation makes a host system call, not across the exits in between.
+ *
+ * @param vm Pointer to the guest structure.
+ * @param operation The file operation to start (OPEN, CLOSE, READ, WRITE).
+ * @return 0 on success.
+ */
+int start_file_operation(struct guest* vm, int operation) {
+    vm->lock = operation;
+    vm->current_fd = -1;
+    vm->write_len = 0;
+    vm->file_nargs = 0;
+
+    if (operation == OPEN) {
+        // The file joins the file list once it is open
+        vm->current_file = init_file();
+    }
+
+    return 0;
+}
+
+void access_record(struct guest* vm, struct file* file, off_t offset, size_t len, int is_read);
+off_t file_offset(int fd);
+struct file* find_file(struct guest* vm, int fd);
+int file_op_offload(struct guest* vm, int (*step)(struct guest*));
+
+/**
+ * Finds an open file of the guest VM and pins it, so a request can use it without the guest's files locked.
+ * Closing the file waits until it is unpinned.
+ *
+ * @param vm Pointer to the guest structure.
+ * @param fd File descriptor.
+ * @return Pointer to the file, NULL if the guest has no such file open.
+ */
+struct file* pin_file(struct guest* vm, int fd) {
+    pthread_mutex_lock(&vm->files_lock);
+    struct file* file = find_file(vm, fd);
+    if (file) file->busy++;
+    pthread_mutex_unlock(&vm->files_lock);
+    return file;
+}
+
+/**
+ * Unpins a file pinned by pin_file once the request is done with it.
+ *
+ * @param vm Pointer to the guest structure.
+ * @param file The file.
+ * @param dirty Nonzero if the request wrote to the file, or failed to sync it.
+ */
+void unpin_file(struct guest* vm, struct file* file, int dirty) {
+    pthread_mutex_lock(&vm->files_lock);
+    if (dirty) file->dirty = 1;
+    if (--file->busy == 0) pthread_cond_broadcast(&vm->files_cond);
+    pthread_mutex_unlock(&vm->files_lock);
+}
+
+/**
+ * Writes the data buffered by the current WRITE operation to its file as one request to the host I/O.
+ *
+ * @param vm Pointer to the guest structure.
+ * @return 0 on success.
+ */
+int flush_write(struct guest* vm) {
+    uint32_t len = vm->write_len;
+    vm->write_len = 0;
+    struct file* file = len > 0 ? pin_file(vm, vm->current_fd) : NULL;
+    if (file == NULL) return 0;
+
+    io_acquire(vm);
+    ssize_t done = write(file->fd, vm->write_buf, len);
+    off_t offset = done > 0 ? file_offset(file->fd) : -1;
+    io_release(vm, done > 0 ? done : 0);
+
+    if (offset >= 0) access_record(vm, file, offset - done, done, 0);
+    unpin_file(vm, file, done > 0);
+    return 0;
+}
+
+/**
+ * Ends a file operation by writing out its buffered data and resetting the lock and current file.
+ *
+ * @param vm Pointer to the guest structure.
+ * @return 0 on success.
+ */
+int end_file_operation(struct guest* vm) {
+    if (vm->lock == WRITE && vm->write_len > 0) file_op_offload(vm, flush_write);
+
+    // An OPEN that never reached its mode leaves a file that was not opened
+    free_file(vm->current_file);
+    vm->current_file = NULL;
+    vm->current_fd = -1;
+    vm->lock = 0;
+    return 0;
+}
+
+/**
+ * Copies data between two files in the host. Uses copy_file_range, which can share extents or copy
+ * inside the kernel, and falls back to splice through a pipe and then to read and write when the files
+ * do not support it (for example a destination opened with O_APPEND).
+ *
+ * @param in Source file descriptor, read from its current offset.
+ * @param out Destination file descriptor, written at its current offset.
+ * @param len Number of bytes to copy.
+ * @return Number of bytes copied, -1 if nothing could be copied.
+ */
+ssize_t copy_range(int in, int out, size_t len) {
+    size_t total = 0;
+
+    while (total < len) {
+        ssize_t n = copy_file_range(in, NULL, out, NULL, len - total, 0);
+        if (n < 0 && total == 0 && (errno == EXDEV || errno == EINVAL || errno == EBADF || errno == ENOSYS || errno == EOPNOTSUPP)) break;
+        if (n <= 0) return total > 0 ? (ssize_t)total : n;
+        total += n;
+    }
+    if (total == len) return total;
+
+    // Splice through a pipe, the data still stays in the kernel
+    int pipe_fds[2];
+    if (pipe(pipe_fds) == 0) {
+        while (total < len) {
+            ssize_t n = splice(in, NULL, pipe_fds[1], NULL, len - total, SPLICE_F_MOVE);
+            if (n <= 0) break;
+            ssize_t moved = 0;
+            while (moved < n) {
+                ssize_t m = splice(pipe_fds[0], NULL, out, NULL, n - moved, SPLICE_F_MOVE);
+                if (m <= 0) break;
+                moved += m;
+            }
+            total += moved;
+            if (moved < n) break;
+        }
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        if (total > 0) return total;
+    }
+
+    // Copy through a buffer
+    char buf[65536];
+    while (total < len) {
+        ssize_t n = read(in, buf, len - total < sizeof(buf) ? len - total : sizeof(buf));
+        if (n <= 0) break;
+        if (write(out, buf, n) != n) return total > 0 ? (ssize_t)total : -1;
+        total += n;
+    }
+
+    return total;
+}
+
+// Content-addressed store deduplicating the outputs of the guests, disabled unless a directory is given
+struct dedup_store {
+    const char* dir; // Directory holding the blobs, named by the hash and size of their contents
+};
+
+struct dedup_store dedup;
+
+typedef uint32_t hash_lanes __attribute__((vector_size(32)));
+
+/**
+ * Hashes a buffer with eight 32-bit lanes processed in parallel, compiled for AVX2 and for the SSE2
+ * baseline and picked at load time. The hash only names blobs in the store, contents are compared before
+ * files are linked, so it needs to be fast rather than collision resistant. It is optimized even though
+ * the rest of the hypervisor is built without optimization.
+ *
+ * @param data Pointer to the data.
+ * @param len Length of the data in bytes.
+ * @param digest Array receiving the 128-bit digest.
+ */
+__attribute__((target_clones("avx2", "default"), optimize("O3")))
+void dedup_hash(const unsigned char* data, size_t len, uint64_t digest[2]) {
+    const uint32_t prime1 = 0x9E3779B1U, prime2 = 0x85EBCA77U;
+    hash_lanes acc = { 1, 2, 3, 4, 5, 6, 7, 8 };
+    hash_lanes block;
+    size_t i = 0;
+
+    acc *= prime1;
+    for (; i + sizeof(block) <= len; i += sizeof(block)) {
+        memcpy(&block, data + i, sizeof(block));
+        acc += block * prime2;
+        acc = (acc << 13) | (acc >> 19);
+        acc *= prime1;
+    }
+
+    // Pad the tail with zeros, the length is mixed in below
+    if (i < len) {
+        memset(&block, 0, sizeof(block));
+        memcpy(&block, data + i, len - i);
+        acc += block * prime2;
+        acc = (acc << 13) | (acc >> 19);
+        acc *= prime1;
+    }
+
+    // Fold the lanes into two 64-bit halves
+    uint64_t h1 = len, h2 = ~(uint64_t)len;
+    for (int lane = 0; lane < 8; lane++) {
+        h1 = (h1 ^ acc[lane]) * 0x9E3779B97F4A7C15ULL;
+        h1 ^= h1 >> 32;
+        h2 = (h2 + acc[lane]) * 0xC2B2AE3D27D4EB4FULL;
+        h2 ^= h2 >> 29;
+    }
+    digest[0] = h1;
+    digest[1] = h2 ^ h1;
+}
+
+/**
+ * Compares the contents of two files of the same size.
+ *
+ * @param a File descriptor of the first file.
+ * @param b File descriptor of the second file.
+ * @param size Size of the files in bytes.
+ * @return 1 if the contents are equal, 0 otherwise.
+ */
+int files_equal(int a, int b, size_t size) {
+    char* pa = mmap(NULL, size, PROT_READ, MAP_PRIVATE, a, 0);
+    char* pb = mmap(NULL, size, PROT_READ, MAP_PRIVATE, b, 0);
+    int equal = pa != MAP_FAILED && pb != MAP_FAILED && memcmp(pa, pb, size) == 0;
+
+    if (pa != MAP_FAILED) munmap(pa, size);
+    if (pb != MAP_FAILED) munmap(pb, size);
+    return equal;
+}
+
+/**
+ * Replaces a file with a copy of a blob in the store, preferring a reflink, which shares the data but
+ * lets each copy be written independently, and falling back to a hard link.
+ *
+ * @param vm Pointer to the guest structure.
+ * @param blob_fd File descriptor of the blob.
+ * @param blob Path of the blob.
+ * @param path Path of the file to replace.
+ * @return 0 on success, -1 on failure.
+ */
+int dedup_replace(struct guest* vm, int blob_fd, const char* blob, const char* path) {
+    char tmp[256];
+    snprintf(tmp, sizeof(tmp), "%s.dedup", path);
+    unlink(tmp);
+
+    int tmp_fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (tmp_fd >= 0 && ioctl(tmp_fd, FICLONE, blob_fd) == 0) {
+        close(tmp_fd);
+        vm->dedup.reflinks++;
+    } else {
+        if (tmp_fd >= 0) {
+            close(tmp_fd);
+            unlink(tmp);
+        }
+        if (link(blob, tmp) < 0) return -1;
+        vm->dedup.links++;
+    }
+
+    if (rename(tmp, path) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Hashes the guest's own copy of an output and stores it in the content-addressed store if its contents are
+ * new, or otherwise replaces it by the blob already stored. The caller holds the guest's dedup lock.
+ *
+ * @param vm Pointer to the guest structure.
+ * @param file The file being closed.
+ * @return Number of bytes hashed.
+ */
+uint64_t dedup_output(struct guest* vm, struct file* file) {
+    // Only the guest's own copy is an output
+    char path[200];
+    struct stat st, fst;
+    snprintf(path, sizeof(path), "vm_%d_%s", vm->id, file->ime);
+    if (stat(path, &st) < 0 || fstat(file->fd, &fst) < 0 || st.st_ino != fst.st_ino || st.st_dev != fst.st_dev) return 0;
+    if (st.st_size == 0 || st.st_nlink > 1) return 0;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    char* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        close(fd);
+        return 0;
+    }
+
+    uint64_t start = monotonic_ns();
+    uint64_t digest[2];
+    dedup_hash((unsigned char*)data, st.st_size, digest);
+    vm->dedup.hash_ns += monotonic_ns() - start;
+    vm->dedup.hashed_bytes += st.st_size;
+    munmap(data, st.st_size);
+
+    char blob[512];
+    snprintf(blob, sizeof(blob), "%s/%016" PRIx64 "%016" PRIx64 "-%" PRIu64, dedup.dir, digest[0], digest[1], (uint64_t)st.st_size);
+
+    int blob_fd = open(blob, O_RDONLY);
+    if (blob_fd < 0) {
+        // New contents, the output itself becomes the blob
+        if (link(path, blob) == 0) vm->dedup.stored++;
+    } else {
+        if (files_equal(fd, blob_fd, st.st_size) && dedup_replace(vm, blob_fd, blob, path) == 0) {
+            vm->dedup.saved_bytes += st.st_size;
+        }
+        close(blob_fd);
+    }
+    close(fd);
+    return st.st_size;
+}
+
+/**
+ * Deduplicates an output file when the guest closes it. The caller checks that no other descriptor of the
+ * guest has the file open.
+ *
+ * @param vm Pointer to the guest structure.
+ * @param file The file being closed.
+ * @return Number of bytes hashed.
+ */
+uint64_t dedup_file(struct guest* vm, struct file* file) {
+    if (dedup.dir == NULL || !(file->flags & (O_WRONLY | O_RDWR))) return 0;
+
+    pthread_mutex_lock(&vm->dedup_lock);
+    uint64_t hashed = dedup_output(vm, file);
+    pthread_mutex_unlock(&vm->dedup_lock);
+    return hashed;
+}
+
+/**
+ * Gives the guest a private copy of a deduplicated file before it writes to it, so the blob and the
+ * outputs of other guests linked to it stay unchanged. Reflinked copies are private already.
+ *
+ * @param vm Pointer to the guest structure.
+ * @param path Path of the guest's own copy.
+ * @param flags Flags the file is being opened with.
+ */
+void dedup_unshare(struct guest* vm, const char* path, int flags) {
+    if (dedup.dir == NULL || !(flags & (O_WRONLY | O_RDWR))) return;
+
+    // Opens and closes of the same output may run at once, only one of them changes it at a time
+    pthread_mutex_lock(&vm->dedup_lock);
+    struct stat st;
+    if (stat(path, &st) < 0 || st.st_nlink < 2) {
+        pthread_mutex_unlock(&vm->dedup_lock);
+        return;
+    }
+
+    vm->dedup.unshares++;
+    if (flags & O_TRUNC) {
+        unlink(path); // The contents are discarded anyway
+    } else {
+        char tmp[256];
+        snprintf(tmp, sizeof(tmp), "%s.dedup", path);
+        int in = open(path, O_RDONLY);
+        int out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 0777);
+        if (in >= 0 && out >= 0 && copy_range(in, out, st.st_size) == st.st_size) {
+            rename(tmp, path);
+        } else {
+            unlink(tmp);
+        }
+        if (in >= 0) close(in);
+        if (out >= 0) close(out);
+    }
+    pthread_mutex_unlock(&vm->dedup_lock);
+}
+
+// Directory the guests' files are resolved in, opened once so lookups start from it
+int path_dir_fd = -1;
+
+/**
+ * Allocates the path cache of a guest VM, opening the directory the files are resolved in on first use.
+ *
+ * @param vm Pointer to the guest structure.
+ * @return 0 on success, -1 on failure.
+ */
+int init_path_cache(struct guest* vm) {
+    if (path_dir_fd < 0) {
+        path_dir_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (path_dir_fd < 0) {
+            perror("ERROR: Unable to open the working directory\n");
+            return -1;
+        }
+    }
+
+    vm->paths = calloc(1, sizeof(struct path_cache));
+    if (vm->paths == NULL) {
+        perror("ERROR: Failed to allocate path cache\n");
+        return -1;
+    }
+    pthread_mutex_init(&vm->paths->lock, NULL);
+
+    return 0;
+}
+
+/**
+ * Returns the cache entry a file name maps to, the cache is direct-mapped.
+ *
+ * @param vm Pointer to the guest structure.
+ * @param name Name of the file.
+ * @return Pointer to the entry, which may hold another name.
+ */
+struct path_entry* path_slot(struct guest* vm, const char* name) {
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (const char* c = name; *c; c++) {
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    }
+    return &vm->paths->entries[hash % PATH_CACHE_SIZE];
+}
+
+/**
+ * Looks up where a file name resolves to. Negative entries expire, since other guests and the host may
+ * create shared files.
+ *
+ * @param vm Pointer to the guest structure.
+ * @param name Name of the file.
+ * @return Cached resolution, PATH_UNKNOWN if the name is not cached.
+ */
+enum PathState path_lookup(struct guest* vm, const char* name) {
+    struct path_entry* entry = path_slot(vm, name);
+    enum PathState state = PATH_UNKNOWN;
+
+    pthread_mutex_lock(&vm->paths->lock);
+    if (entry->state == PATH_UNKNOWN || strcmp(entry->name, name) != 0 ||
+        (entry->state == PATH_MISSING && monotonic_ns() > entry->expires_ns)) {
+        vm->paths->misses++;
+    } else {
+        state = entry->state;
+        vm->paths->hits[state]++;
+    }
+    pthread_mutex_unlock(&vm->paths->lock);
+
+    return state;
+}
+
+/**
+ * Records where a file name resolves to, replacing the name the entry held before.
+ *
+ * @param vm Pointer to the guest structure.
+ * @param name Name of the file.
+ * @param state Resolution of the name.
+ */
+void path_store(struct guest* vm, const char* name, enum PathState state) {
+    struct path_entry* entry = path_slot(vm, name);
+
+    if (strlen(name) >= sizeof(entry->name)) return;
+    pthread_mutex_lock(&vm->paths->lock);
+    strcpy(entry->name, name);
+    entry->state = state;
+    if (state == PATH_MISSING) entry->expires_ns = monotonic_ns() + PATH_NEGATIVE_TTL_MS * 1000000ULL;
+    pthread_mutex_unlock(&vm->paths->lock);
+}
+
+/**
+ * Opens a file for the guest VM. Files the guest has its own copy of are opened from the copy, files opened
+ * for writing get a copy, and other files are opened from the shared directory. The path cache remembers
+ * which of them a name resolves to, so an open usually costs a single openat. Cached copies and shared
+ * files that have disappeared are resolved again.
+ *
+ * @param vm Pointer to the guest structure.
+ * @param name Name of the file.
+ * @param flags Flags for opening the file.
+ * @param mode Mode for opening the file.
+ * @return File descriptor of the opened file, -1 on failure.
+ */
+int open_guest_file(struct guest* vm, const char* name, int flags, mode_t mode) {
+    char local[200];
+    snprintf(local, sizeof(local), "vm_%d_%s", vm->id, name);
+    int writes = flags & (O_RDWR | O_WRONLY | O_TRUNC | O_APPEND);
+    enum PathState state = path_lookup(vm, name);
+
+    if (state == PATH_MISSING && !writes && !(flags & O_CREAT)) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    int fd;
+    if (state == PATH_OVERLAY || state == PATH_UNKNOWN) {
+        if (dedup.dir) dedup_unshare(vm, local, flags);
+
+        // Open the guest's own copy if it exists
+        fd = openat(path_dir_fd, local, flags & ~O_CREAT, mode);
+        if (fd >= 0) {
+            path_store(vm, name, PATH_OVERLAY);
+            return fd;
+        }
+        if (errno != ENOENT) return -1;
+        __atomic_fetch_add(&vm->paths->stale, state == PATH_OVERLAY, __ATOMIC_RELAXED);
+    }
+
+    if (writes) {
+        // The guest writes to its own copy, created on first use
+        fd = openat(path_dir_fd, local, flags | O_CREAT, 0777);
+        if (fd >= 0) path_store(vm, name, PATH_OVERLAY);
+        return fd;
+    }
+
+    fd = openat(path_dir_fd, name, flags, mode);
+    if (fd >= 0) {
+        path_store(vm, name, PATH_SHARED);
+    } else if (errno == ENOENT) {
+        __atomic_fetch_add(&vm->paths->stale, state == PATH_SHARED, __ATOMIC_RELAXED);
+        if (!(flags & O_CREAT)) path_store(vm, name, PATH_MISSING);
+        errno = ENOENT;
+    }
+    return fd;
+}
+
+/**
+ * Gets the status of the file a name of the guest VM resolves to, through the path cache.
+ *
+ * @param vm Pointer to the guest structure.
+ * @param name Name of the file.
+ * @param st Pointer to store the status.
+ * @return 0 on success, -1 on failure.
+ */
+int stat_guest_file(struct guest* vm, const char* name, struct stat* st) {
+    char local[200];
+    snprintf(local, sizeof(local), "vm_%d_%s", vm->id, name);
+    enum PathState state = path_lookup(vm, name);
+
+    if (state == PATH_MISSING) {
+        errno = ENOENT;
+        return -1;
+    }
+    if (state != PATH_SHARED) {
+        if (fstatat(path_dir_fd, local, st, 0) == 0) {
+            path_store(vm, name, PATH_OVERLAY);
+            return 0;
+        }
+        if (errno != ENOENT) return -1;
+        __atomic_fetch_add(&vm->paths->stale, state == PATH_OVERLAY, __ATOMIC_RELAXED);
+    }
+
+    if (fstatat(path_dir_fd, name, st, 0) == 0) {
+        path_store(vm, name, PATH_SHARED);
+        return 0;
+    }
+    if (errno == ENOENT) {
+        __atomic_fetch_add(&vm->paths->stale, state == PATH_SHARED, __ATOMIC_RELAXED);
+        path_store(vm, name, PATH_MISSING);
+        errno = ENOENT;
+    }
+    return -1;
+}
+
+/**
+ * Opens the file of the current OPEN operation as one request to the host I/O.
+ *
+ * @param vm Pointer to the guest structure.
+ * @return 0 on success.
+ */
+int opened_file_op_open(struct guest* vm) {
+    struct file* file = vm->current_file;
+
+    io_acquire(vm);
+    file->fd = open_guest_file(vm, file->ime, file->flags, file->mode);
+    io_release(vm, 0);
+    file->dirty = (file->flags & O_TRUNC) != 0;
+
+    // Only open files are in the file list, where the requests of the file ring find them
+    vm->current_fd = file->fd;
+    vm->current_file = NULL;
+    if (file->fd >= 0) {
+        pthread_mutex_lock(&vm->files_lock);
+        link_file(vm, file);
+        pthread_mutex_unlock(&vm->files_lock);
+    } else {
+        free_file(file);
+    }
+
+    return 0;
+}
+
+/**
+ * Handles setting the flags and mode for an opened file operation.
+ *
+ * @param vm Pointer to the guest structure.
+ * @param data Flags or mode for the file operation.
+ * @return 0 on success.
+ */
+int opened_file_op_flags(struct guest* vm, int data) {
+    struct file* file = vm->current_file;
+    if (file == NULL) return 0;
+
+    if (file->flags == -1) {
+        // Set the flags if they are not already set
+        file->flags = data;
+    } else {
+        // Set the mode and open the file if the flags are already set
+        file->mode = data;
+        file_op_offload(vm, opened_file_op_open);
+    }
+
+    return 0;
+}
+
+/**
+ * Sends the file descriptor of the currently opened file to the guest VM.
+ *
+ * @param vm Pointer to the guest structure.
+ * @return 0 on success.
+ */
+int opened_file_op_send_fd(struct guest* vm) {
+    *((int*)((char*)vm->kvm_run + vm->kvm_run->io.data_offset)) = vm->current_fd;
+    return end_file_operation(vm);
+}
+
+/**
+ * Handles setting the name for an opened file operation.
+ *
+ * @param vm Pointer to the guest structure.
+ * @param data Character data for the file name.
+ * @return 0 on success.
+ */
+int opened_file_op_name(struct guest* vm, char data) {
+    struct file* file = vm->current_file;
+    if (file && file->cnt < (int)sizeof(file->ime)) file->ime[file->cnt++] = data;
+    return 0;
+}
+
+/**
+ * Sets the file descriptor the current operation applies to. The file is looked up whenever the operation
+ * uses it, since a request of the file ring may close it in between.
+ *
+ * @param vm Pointer to the guest structure.
+ * @param data File descriptor.
+ * @return 0 on success.
+ */
+int get_file_descriptor(struct guest* vm, int data) {
+    vm->current_fd = data;
+    return 0;
+}
+
+// Request to sync a file, waiting on the stack of the thread that needs it durable
+struct commit_request {
+    struct guest* vm; // Guest VM the request is made for
+    int fd; // File descriptor of the file
+    dev_t dev; // Device of the file, requests for the same file share one sync
+    ino_t ino; // Inode of the file
+    int status; // 0 once synced, -1 on failure
+    int done; // Set once the request is complete
+    uint64_t enqueued_ns; // Time the request was made
+    struct commit_request* next; // Next pending request
+};
+
+// Thread syncing the files of all guests in batches. Requests arriving while a batch is being synced wait
+// for the next batch, so concurrent requests share the cost of the sync instead of queuing behind each other.
+struct group_commit {
+    pthread_mutex_t lock; // Protects the pending requests and the counters
+    pthread_cond_t cond; // Signaled when requests are added
+    pthread_cond_t done_cond; // Signaled when a batch is complete
+    struct commit_request* head; // Pending requests
+    struct commit_request** tail; // Append pointer of the pending requests
+    pthread_t thread; // Thread syncing the batches
+    int started; // Set once the thread runs
+    int stop; // Set to stop the thread
+    uint64_t batches; // Number of batches synced
+    uint64_t requests; // Number of requests served
+    uint64_t syncs; // Number of fdatasync calls
+    uint64_t syncfs; // Number of batches synced with one syncfs
+    uint64_t batch_sizes[COMMIT_BATCH_BUCKETS]; // Batches with at most 1, 2, 4, ... requests
+    uint64_t sync_ns; // Time spent syncing
+    uint64_t max_batch; // Largest batch
+};
+
+struct group_commit group_commit = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER,
+                                     .done_cond = PTHREAD_COND_INITIALIZER, .tail = &group_commit.head };
+
+/**
+ * Syncs batches of commit requests. Each file in a batch is synced once, and a batch touching many files of
+ * one filesystem is synced with a single syncfs.
+ *
+ * @param arg Unused.
+ * @return NULL when stopped.
+ */
+void* run_group_commit(void* arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&group_commit.lock);
+        while (group_commit.head == NULL && !group_commit.stop) {
+            pthread_cond_wait(&group_commit.cond, &group_commit.lock);
+        }
+        struct commit_request* batch = group_commit.head;
+        group_commit.head = NULL;
+        group_commit.tail = &group_commit.head;
+        pthread_mutex_unlock(&group_commit.lock);
+        if (batch == NULL) break;
+
+        // Count the distinct files and check whether they share a filesystem
+        uint64_t start = monotonic_ns();
+        int size = 0, files = 0, one_fs = 1;
+        for (struct commit_request* request = batch; request; request = request->next) {
+            struct commit_request* first = batch;
+            while (first != request && (first->dev != request->dev || first->ino != request->ino)) first = first->next;
+            files += first == request;
+            one_fs &= request->dev == batch->dev;
+            size++;
+        }
+
+        uint64_t syncs = 0;
+        if (files >= COMMIT_SYNCFS_MIN && one_fs) {
+            int status = syncfs(batch->fd) == 0 ? 0 : -1;
+            for (struct commit_request* request = batch; request; request = request->next) request->status = status;
+        } else {
+            for (struct commit_request* request = batch; request; request = request->next) {
+                struct commit_request* first = batch;
+                while (first != request && (first->dev != request->dev || first->ino != request->ino)) first = first->next;
+                if (first == request) {
+                    request->status = fdatasync(request->fd) == 0 ? 0 : -1;
+                    syncs++;
+                } else {
+                    request->status = first->status;
+                }
+            }
+        }
+        uint64_t end = monotonic_ns();
+
+        pthread_mutex_lock(&group_commit.lock);
+        group_commit.batches++;
+        group_commit.requests += size;
+        group_commit.syncs += syncs;
+        group_commit.syncfs += syncs == 0;
+        group_commit.sync_ns += end - start;
+        if ((uint64_t)size > group_commit.max_batch) group_commit.max_batch = size;
+        int bucket = 0;
+        while (bucket < COMMIT_BATCH_BUCKETS - 1 && size > (1 << bucket)) bucket++;
+        group_commit.batch_sizes[bucket]++;
+
+        for (struct commit_request* request = batch; request; request = request->next) {
+            struct io_account* io = request->vm->io;
+            uint64_t latency = end - request->enqueued_ns;
+            io->commits++;
+            io->commit_ns += latency;
+            if (latency > io->max_commit_ns) io->max_commit_ns = latency;
+            request->done = 1;
+        }
+        pthread_cond_broadcast(&group_commit.done_cond);
+        pthread_mutex_unlock(&group_commit.lock);
+    }
+
+    return NULL;
+}
+
+/**
+ * Syncs a file through the group commit thread and waits until it is durable. The caller must not hold
+ * the host I/O, so that other guests can add their requests to the same batch.
+ *
+ * @param vm Pointer to the guest structure.
+ * @param fd File descriptor of the file.
+ * @return 0 on success, -1 on failure.
+ */
+int commit_sync(struct guest* vm, int fd) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) return -1;
+
+    struct commit_request request = { .vm = vm, .fd = fd, .dev = st.st_dev, .ino = st.st_ino,
+                                      .enqueued_ns = monotonic_ns() };
+
+    pthread_mutex_lock(&group_commit.lock);
+    if (!group_commit.started) {
+        if (pthread_create(&group_commit.thread, NULL, run_group_commit, NULL) != 0) {
+            pthread_mutex_unlock(&group_commit.lock);
+            perror("ERROR: Failed to create group commit thread\n");
+            return fdatasync(fd);
+        }
+        group_commit.started = 1;
+    }
+    *group_commit.tail = &request;
+    group_commit.tail = &request.next;
+    pthread_cond_signal(&group_commit.cond);
+    while (!request.done) {
+        pthread_cond_wait(&group_commit.done_cond, &group_commit.lock);
+    }
+    pthread_mutex_unlock(&group_commit.lock);
+
+    return request.status;
+}
+
+/**
+ * Stops the group commit thread once no guest can make requests.
+ */
+void stop_group_commit() {
+    pthread_mutex_lock(&group_commit.lock);
+    int started = group_commit.started;
+    group_commit.stop = 1;
+    pthread_cond_signal(&group_commit.cond);
+    pthread_mutex_unlock(&group_commit.lock);
+
+    if (started) pthread_join(group_commit.thread, NULL);
+}
+
+/**
+ * Writes the group commit metrics, shared by all guest VMs.
+ *
+ * @param out Output file.
+ */
+void write_commit_metrics(FILE* out) {
+    fprintf(out, "minihv_commit_batches_total %" PRIu64 "\n", group_commit.batches);
+    fprintf(out, "minihv_commit_requests_total %" PRIu64 "\n", group_commit.requests);
+    fprintf(out, "minihv_commit_fdatasync_total %" PRIu64 "\n", group_commit.syncs);
+    fprintf(out, "minihv_commit_syncfs_total %" PRIu64 "\n", group_commit.syncfs);
+    fprintf(out, "minihv_commit_sync_seconds_total %.9f\n", group_commit.sync_ns / 1e9);
+    fprintf(out, "minihv_commit_batch_size_max %" PRIu64 "\n", group_commit.max_batch);
+
+    uint64_t count = 0;
+    for (int i = 0; i < COMMIT_BATCH_BUCKETS; i++) {
+        count += group_commit.batch_sizes[i];
+        if (i < COMMIT_BATCH_BUCKETS - 1) {
+            fprintf(out, "minihv_commit_batch_size_bucket{le=\"%d\"} %" PRIu64 "\n", 1 << i, count);
+        } else {
+            fprintf(out, "minihv_commit_batch_size_bucket{le=\"+Inf\"} %" PRIu64 "\n", count);
+        }
+    }
+    fprintf(out, "minihv_commit_batch_size_sum %" PRIu64 "\n", group_commit.requests);
+    fprintf(out, "minihv_commit_batch_size_count %" PRIu64 "\n", group_commit.batches);
+}
+
+/**
+ * Drops the cached pages of a file that a sequential reader has left behind, keeping ACCESS_DROP_LAG bytes
+ * behind the reader for other readers of the same file.
+ *
+ * @param fd File descriptor of the file.
+ * @param dropped Pointer to the offset up to which pages were dropped.
+ * @param offset Offset the reader has reached.
+ * @return Number of bytes dropped.
+ */
+uint64_t access_drop_behind(int fd, off_t* dropped, off_t offset) {
+    off_t end = offset - ACCESS_DROP_LAG;
+    if (end - *dropped < ACCESS_DROP_CHUNK) return 0;
+
+    end &= ~(off_t)(PAGE_SIZE - 1);
+    posix_fadvise(fd, *dropped, end - *dropped, POSIX_FADV_DONTNEED);
+    uint64_t bytes = end - *dropped;
+    *dropped = end;
+    return bytes;
+}
+
+/**
+ * Switches the caching policy of a file and gives the kernel the matching hint.
+ *
+ * @param file Pointer to the file.
+ * @param policy The new policy.
+ * @param offset Offset of the current request.
+ * @param len Length of the current request.
+ */
+void access_set_policy(struct file* file, enum AccessPolicy policy, off_t offset, size_t len) {
+    struct access_pattern* access = &file->access;
+
+    access->policy = policy;
+    if (policy == ACCESS_SEQUENTIAL) {
+        // Double the kernel readahead window and drop pages from here on
+        posix_fadvise(file->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        access->readahead_end = offset + len;
+        if (access->dropped < offset - ACCESS_DROP_LAG) access->dropped = offset - ACCESS_DROP_LAG;
+        if (access->dropped < 0) access->dropped = 0;
+    } else {
+        // Readahead only wastes memory for strided and random access
+        posix_fadvise(file->fd, 0, 0, POSIX_FADV_RANDOM);
+    }
+}
+
+/**
+ * Records a request on a file and classifies the access pattern. A pattern is adopted after ACCESS_MIN_RUN
+ * consecutive requests of the same kind: sequential readers get readahead and their pages dropped behind
+ * them, strided readers get the next strides prefetched, and random readers get readahead turned off.
+ * Concurrent requests on the file record their accesses one at a time.
+ *
+ * @param vm Pointer to the guest structure.
+ * @param file Pointer to the file.
+ * @param offset Offset of the request.
+ * @param len Length of the request.
+ * @param is_read Nonzero for reads, zero for writes.
+ */
+void access_record(struct guest* vm, struct file* file, off_t offset, size_t len, int is_read) {
+    struct access_pattern* access = &file->access;
+    if (len == 0) return;
+
+    pthread_mutex_lock(&file->access_lock);
+    enum AccessPolicy kind = ACCESS_NORMAL;
+    int64_t delta = offset - access->last_offset;
+    if (access->requests > 0 && offset == access->next) {
+        kind = ACCESS_SEQUENTIAL;
+    } else if (access->requests > 1 && delta == access->stride) {
+        kind = ACCESS_STRIDED;
+    } else if (access->requests > 0) {
+        kind = ACCESS_RANDOM;
+    }
+    access->stride = delta;
+    access->last_offset = offset;
+    access->next = offset + len;
+    access->requests++;
+
+    access->run = kind == access->kind ? access->run + 1 : 1;
+    access->kind = kind;
+    if (kind != ACCESS_NORMAL && kind != access->policy && access->run >= ACCESS_MIN_RUN) {
+        access_set_policy(file, kind, offset, len);
+    }
+
+    if (access->policy == ACCESS_SEQUENTIAL && kind == ACCESS_SEQUENTIAL) {
+        // Keep a window read ahead of the reader, refilled once it is half consumed
+        if (is_read && access->next + ACCESS_READAHEAD / 2 > access->readahead_end) {
+            if (access->readahead_end < access->next) access->readahead_end = access->next;
+            readahead(file->fd, access->readahead_end, ACCESS_READAHEAD);
+            access->readahead_end += ACCESS_READAHEAD;
+            __atomic_fetch_add(&vm->access_readahead_bytes, ACCESS_READAHEAD, __ATOMIC_RELAXED);
+        }
+        if (is_read) {
+            uint64_t dropped = access_drop_behind(file->fd, &access->dropped, access->next);
+            __atomic_fetch_add(&vm->access_dropped_bytes, dropped, __ATOMIC_RELAXED);
+        }
+    } else if (access->policy == ACCESS_STRIDED && kind == ACCESS_STRIDED) {
+        // Prefetch the stride ACCESS_PREFETCH_STRIDES ahead, the ones before it were prefetched earlier
+        int first = access->run == ACCESS_MIN_RUN ? 1 : ACCESS_PREFETCH_STRIDES;
+        for (int i = first; i <= ACCESS_PREFETCH_STRIDES; i++) {
+            off_t ahead = offset + i * access->stride;
+            if (ahead < 0) break;
+            posix_fadvise(file->fd, ahead, len, POSIX_FADV_WILLNEED);
+            __atomic_fetch_add(&vm->access_readahead_bytes, len, __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&file->access_lock);
+}
+
+/**
+ * Records the policy a file ended up with when it is closed.
+ *
+ * @param vm Pointer to the guest structure.
+ * @param file Pointer to the file.
+ */
+void access_report(struct guest* vm, struct file* file) {
+    vm->access_files[file->access.policy]++;
+    if (file->access.policy == ACCESS_NORMAL || vm->num_access_reports == ACCESS_REPORT_MAX) return;
+
+    struct access_report* report = &vm->access_reports[vm->num_access_reports++];
+    memcpy(report->name, file->ime, sizeof(report->name));
+    report->policy = file->access.policy;
+    report->requests = file->access.requests;
+}
+
+/**
+ * Returns the current offset of a file, where the next read or write on it starts.
+ *
+ * @param fd File descriptor of the file.
+ * @return The offset, -1 if the file has none.
+ */
+off_t file_offset(int fd) {
+    return lseek(fd, 0, SEEK_CUR);
+}
+
+/**
+ * Removes a file from the file list of the guest VM. Its file descriptor no longer finds it.
+ *
+ * @param vm Pointer to the guest structure.
+ * @param file The file to remove.
+ */
+void unlink_file(struct guest* vm, struct file* file) {
+    for (struct file** indirect = &vm->file_head; *indirect; indirect = &(*indirect)->next) {
+        if (*indirect == file) {
+            *indirect = file->next;
+            // Keep the append pointer valid when the last file is removed
+            if (vm->file_indirect == &file->next) vm->file_indirect = indirect;
+            break;
+        }
+    }
+}
+
+/**
+ * Closes a file of the guest VM, syncing it first if the guest's durability mode requires it, and removes
+ * it from the file list. The file is removed first, so a concurrent close or sync of the same file
+ * descriptor fails instead of using it, and it is closed once the requests still using it are done. The
+ * sync and the close run without the guest's files locked.
+ *
+ * @param vm Pointer to the guest structure.
+ * @param fd File descriptor of the file.
+ * @return 0 on success, -EBADF if the guest has no such file open, -EIO on failure.
+ */
+int close_guest_file(struct guest* vm, int fd) {
+    pthread_mutex_lock(&vm->files_lock);
+    struct file* file = find_file(vm, fd);
+    if (file == NULL) {
+        pthread_mutex_unlock(&vm->files_lock);
+        return -EBADF;
+    }
+    unlink_file(vm, file);
+    while (file->busy > 0) pthread_cond_wait(&vm->files_cond, &vm->files_lock);
+
+    // An output still open through another descriptor is deduplicated when that one is closed
+    int last = 1;
+    for (struct file* current = vm->file_head; current; current = current->next) {
+        if (strcmp(current->ime, file->ime) == 0) last = 0;
+    }
+    access_report(vm, file);
+    pthread_mutex_unlock(&vm->files_lock);
+
+    // Sync the file first if the guest's writes must be durable when it is closed
+    int status = 0;
+    if (vm->io->durability == DURABILITY_CLOSE && file->dirty && commit_sync(vm, file->fd) < 0) status = -EIO;
+
+    io_acquire(vm);
+    uint64_t hashed = last ? dedup_file(vm, file) : 0;
+    if (close(file->fd) < 0) status = -EIO;
+    io_release(vm, hashed);
+
+    free_file(file);
+    return status;
+}
+
+/**
+ * Handles closing a file and updating the file list.
+ *
+ * @param vm Pointer to the guest structure.
+ * @return 0 on success.
+ */
+int close_op_status(struct guest* vm) {
+    int status = close_guest_file(vm, vm->current_fd) < 0 ? -1 : 0;
+    vm->current_fd = -1;
+    *((int*)((char*)vm->kvm_run + vm->kvm_run->io.data_offset)) = status;
+
+    return 0;
+}
+
+/**
+ * Finds an open file of the guest VM by its file descriptor.
+ *
+ * @param vm Pointer to the guest structure.
+ * @param fd File descriptor.
+ * @return Pointer to the file, NULL if the guest has no such file open.
+ */
+struct file* find_file(struct guest* vm, int fd) {
+    for (struct file* current = vm->file_head; current; current = current->next) {
+        if (current->fd == fd) return current;
+    }
+    return NULL;
+}
+
+/**
+ * Syncs a file of the guest VM if it was written since it was last synced, unless the guest's durability
+ * mode is none. The file is pinned while the sync is pending, so closing it waits for the sync instead of
+ * freeing it. Neither the guest's files nor the host I/O are held meanwhile, so other requests of the
+ * guest proceed and other guests can add their syncs to the same batch.
+ *
+ * @param vm Pointer to the guest structure.
+ * @param fd File descriptor of the file.
+ * @return 0 on success, -EBADF if the guest has no such file open, -EIO on failure.
+ */
+int sync_guest_file(struct guest* vm, int fd) {
+    struct file* file = pin_file(vm, fd);
+    if (file == NULL) return -EBADF;
+
+    pthread_mutex_lock(&vm->files_lock);
+    int dirty = file->dirty && vm->io->durability != DURABILITY_NONE;
+    if (dirty) file->dirty = 0; // Writes made while the sync is pending mark the file again
+    pthread_mutex_unlock(&vm->files_lock);
+
+    int status = dirty && commit_sync(vm, file->fd) < 0 ? -EIO : 0;
+    unpin_file(vm, file, status < 0); // A failed sync leaves the file dirty
+    return status;
+}
+
+/**
+ * Handles the FSYNC operation, the guest flushing a file, and sends the status to the guest VM. Unless the
+ * guest's durability mode is none, data written to the file since it was last synced becomes durable.
+ *
+ * @param vm Pointer to the guest structure.
+ * @return 0 on success.
+ */
+int fsync_op_status(struct guest* vm) {
+    int status = sync_guest_file(vm, vm->file_args[0]) < 0 ? -1 : 0;
+
+    *((int*)((char*)vm->kvm_run + vm->kvm_run->io.data_offset)) = status;
+    return 0;
+}
+
+/**
+ * Reads the data of a READ operation into the read buffer as one request to the host I/O and sends its
+ * length to the guest VM. The length is explicit, so every byte value can be read and 0 marks the end of
+ * the file.
+ *
+ * @param vm Pointer to the guest structure.
+ * @return 0 on success.
+ */
+int read_file_op_status(struct guest* vm) {
+    struct file* file = pin_file(vm, vm->file_args[0]);
+    uint32_t len = vm->file_args[1] < FILE_READ_MAX ? vm->file_args[1] : FILE_READ_MAX;
+    ssize_t status = -1;
+
+    vm->read_len = 0;
+    vm->read_pos = 0;
+    if (file) {
+        io_acquire(vm);
+        off_t offset = file_offset(file->fd);
+        status = read(file->fd, vm->read_buf, len);
+        vm->read_len = status > 0 ? status : 0;
+        io_release(vm, vm->read_len);
+
+        if (offset >= 0) access_record(vm, file, offset, vm->read_len, 1);
+        unpin_file(vm, file, 0);
+    }
+
+    *((int*)((char*)vm->kvm_run + vm->kvm_run->io.data_offset)) = status;
+    return 0;
+}
+
+/**
+ * Sends the next character of the read buffer to the guest VM.
+ *
+ * @param vm Pointer to the guest structure.
+ * @return 0 on success.
+ */
+int read_file(struct guest* vm) {
+    char c = vm->read_pos < vm->read_len ? vm->read_buf[vm->read_pos++] : 0;
+    *((char*)vm->kvm_run + vm->kvm_run->io.data_offset) = c;
+    return 0;
+}
+
+/**
+ * Writes a character to a file. Characters are buffered and written once the buffer is full or the
+ * operation ends.
+ *
+ * @param vm Pointer to the guest structure.
+ * @param data Character to write.
+ * @return 0 on success.
+ */
+int write_file(struct guest* vm, char data) {
+    pthread_mutex_lock(&vm->files_lock);
+    struct file* file = find_file(vm, vm->current_fd);
+    pthread_mutex_unlock(&vm->files_lock);
+    if (file == NULL) {
+        *((char*)vm->kvm_run + vm->kvm_run->io.data_offset) = EOF;
+        return 0;
+    }
+
+    vm->write_buf[vm->write_len++] = data;
+    if (vm->write_len == sizeof(vm->write_buf)) file_op_offload(vm, flush_write);
+    return 0;
+}
+
+/**
+ * Returns the number of 32-bit arguments a file operation takes after its code, before the result is read.
+ * Operations not listed select their file with a file descriptor instead.
+ *
+ * @param operation The file operation.
+ * @return Number of arguments.
+ */
+int file_op_num_args(int operation) {
+    switch (operation) {
+        case READ: return 2; // File descriptor, maximum length
+        case COPY: return 3; // Source fd, destination fd, length
+        case STREAM: return 2; // File descriptor, guest address of the stream control block
+        case OPENV: return 2; // Guest address of the requests, number of requests
+        case STATV: return 2; // Guest address of the requests, number of requests
+        case READDIR: return 4; // Guest address of the path, buffer address, buffer size, entries to skip
+        case FSYNC: return 1; // File descriptor
+        case MAP: return 2; // File descriptor, MAP_SHARED or MAP_PRIVATE
+        case PREAD: return 5; // File descriptor, buffer address, length, offset (low and high half)
+        case PWRITE: return 5; // File descriptor, buffer address, length, offset (low and high half)
+        case LSEEK: return 4; // File descriptor, offset (low and high half), SEEK_SET, SEEK_CUR or SEEK_END
+        default: return 0;
+    }
+}
+
+/**
+ * Stores an argument of the current file operation.
+ *
+ * @param vm Pointer to the guest structure.
+ * @param data The argument.
+ * @return 0 on success.
+ */
+int file_op_arg(struct guest* vm, uint32_t data) {
+    vm->file_args[vm->file_nargs++] = data;
+    return 0;
+}
+
+/**
+ * Copies data between two open files of the guest VM on the host, from their current offsets, as one
+ * request to the host I/O.
+ *
+ * @param vm Pointer to the guest structure.
+ * @param src_fd File descriptor of the file to copy from.
+ * @param dst_fd File descriptor of the file to copy to.
+ * @param count Number of bytes to copy, 0 to copy until the end of the source file. At most INT32_MAX bytes
+ *              are copied at once.
+ * @return Number of bytes copied, -EBADF if the guest has no such file open, -EIO on failure.
+ */
+int64_t copy_files(struct guest* vm, int src_fd, int dst_fd, uint32_t count) {
+    size_t len = count ? count : INT32_MAX;
+    if (len > INT32_MAX) len = INT32_MAX;
+
+    struct file* src = pin_file(vm, src_fd);
+    struct file* dst = pin_file(vm, dst_fd);
+    int64_t copied = -EBADF;
+    if (src && dst) {
+        io_acquire(vm);
+        off_t src_offset = file_offset(src->fd), dst_offset = file_offset(dst->fd);
+        copied = copy_range(src->fd, dst->fd, len);
+        io_release(vm, copied > 0 ? copied : 0);
+
+        if (copied < 0) {
+            copied = -EIO;
+        } else {
+            if (copied > 0 && src_offset >= 0) access_record(vm, src, src_offset, copied, 1);
+            if (copied > 0 && dst_offset >= 0) access_record(vm, dst, dst_offset, copied, 0);
+            __atomic_fetch_add(&vm->file_copies, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&vm->file_copy_bytes, copied, __ATOMIC_RELAXED);
+        }
+    }
+
+    if (src) unpin_file(vm, src, 0);
+    if (dst) unpin_file(vm, dst, copied > 0);
+    return copied;
+}
+
+/**
+ * Performs the host-side copy requested with the COPY operation and sends the result to the guest VM.
+ *
+ * @param vm Pointer to the guest structure.
+ * @return 0 on success.
+ */
+int copy_file_op_status(struct guest* vm) {
+    int64_t copied = -1;
+    if (vm->file_nargs == 3) copied = copy_files(vm, vm->file_args[0], vm->file_args[1], vm->file_args[2]);
+
+    *((int*)((char*)vm->kvm_run + vm->kvm_run->io.data_offset)) = copied < 0 ? -1 : copied;
+    return 0;
+}
+
+/**
+ * Maps an open file into the guest as a memory window. The file is mapped with the requested sharing and
+ * padded with anonymous memory up to the 2MB window granularity. Shared mappings of files opened read-only
+ * become read-only windows.
+ *
+ * @param vm Pointer to the guest structure.
+ * @param file The file to map.
+ * @param sharing MAP_SHARED to write through to the file, MAP_PRIVATE for a copy-on-write view.
+ * @param size Pointer to store the size of the file.
+ * @return Guest address of the window, 0 on failure.
+ */
+uint64_t map_file_window(struct guest* vm, struct file* file, int sharing, uint64_t* size) {
+    struct stat st;
+    if ((sharing != MAP_SHARED && sharing != MAP_PRIVATE) || fstat(file->fd, &st) < 0 || st.st_size == 0) return 0;
+
+    int writable = sharing == MAP_PRIVATE || (file->flags & O_ACCMODE) == O_RDWR;
+    int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+    uint64_t window_size = (st.st_size + SIZE2MB - 1) / SIZE2MB * SIZE2MB;
+
+    // Reserve the whole window, then map the file over its start
+    char* host = mmap(NULL, window_size, prot, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (host == MAP_FAILED) {
+        perror("ERROR: Failed to mmap file window\n");
+        return 0;
+    }
+    if (mmap(host, st.st_size, prot, sharing | MAP_FIXED, file->fd, 0) == MAP_FAILED) {
+        perror("ERROR: Failed to mmap file window\n");
+        munmap(host, window_size);
+        return 0;
+    }
+
+    uint64_t gpa = map_window(vm, host, window_size, writable);
+    if (gpa == 0) {
+        munmap(host, window_size);
+        return 0;
+    }
+
+    *size = st.st_size;
+    return gpa;
+}
+
+/**
+ * Handles the results of the MAP operation: the first read maps the file and returns the guest address of
+ * the window (0 on failure), the second returns the size of the file.
+ *
+ * @param vm Pointer to the guest structure.
+ * @return 0 on success.
+ */
+int map_file_op_status(struct guest* vm) {
+    uint32_t* data = (uint32_t*)((char*)vm->kvm_run + vm->kvm_run->io.data_offset);
+
+    if (vm->file_nargs == 2) {
+        struct file* file = pin_file(vm, vm->file_args[0]);
+        uint64_t size = 0;
+        *data = 0;
+        if (file) {
+            io_acquire(vm);
+            *data = map_file_window(vm, file, vm->file_args[1], &size);
+            io_release(vm, 0);
+            unpin_file(vm, file, 0);
+        }
+        file_op_arg(vm, size > UINT32_MAX ? UINT32_MAX : size); // Keep the size for the second read
+    } else {
+        *data = vm->file_nargs == 3 ? vm->file_args[2] : 0;
+    }
+
+    return 0;
+}
+
+// Request of the OPENV operation in guest memory
+struct open_request {
+    uint64_t name; // Guest address of the file name
+    int32_t flags; // Flags for opening the file
+    int32_t mode; // Mode for opening the file
+    int32_t fd; // File descriptor, or the negated errno, written by the host
+    uint32_t reserved;
+};
+
+// Request of the STATV operation in guest memory
+struct stat_request {
+    uint64_t name; // Guest address of the file name
+    int32_t status; // 0, or the negated errno, written by the host
+    uint32_t mode; // File type and permissions
+    uint64_t size; // Size of the file in bytes
+    int64_t mtime_ns; // Last modification time in nanoseconds since the epoch
+};
+
+// Directory entry written by the READDIR operation, records are padded to 8 bytes
+struct dir_record {
+    uint16_t reclen; // Length of the record, including the name and padding
+    uint8_t type; // DT_REG, DT_DIR or another d_type value
+    char name[]; // NUL-terminated name
+};
+
+/**
+ * Opens a batch of files with the OPENV operation. Each request is opened like OPEN and receives its file
+ * descriptor, so a guest opening many files pays for one request instead of one exit per byte of each name.
+ *
+ * @param vm Pointer to the guest structure.
+ * @return Number of files opened.
+ */
+int openv_op_status(struct guest* vm) {
+    uint64_t gva = vm->file_args[0];
+    int opened = 0;
+
+    for (uint32_t i = 0; i < vm->file_args[1] && vm->file_nargs == 2; i++, gva += sizeof(struct open_request)) {
+        struct open_request request;
+        if (copy_guest(vm, gva, &request, sizeof(request), 0) < 0) break;
+
+        char name[sizeof(((struct file*)0)->ime)];
+        if (read_guest_string(vm, request.name, name, sizeof(name)) < 0) {
+            request.fd = -ENAMETOOLONG;
+        } else {
+            int fd = open_guest_file(vm, name, request.flags, request.mode);
+            request.fd = fd >= 0 ? fd : -errno;
+            if (fd >= 0) {
+                pthread_mutex_lock(&vm->files_lock);
+                struct file* file = add_file(vm);
+                file->fd = fd;
+                file->flags = request.flags;
+                file->mode = request.mode;
+                file->dirty = (request.flags & O_TRUNC) != 0;
+                file->cnt = strlen(name) + 1;
+                memcpy(file->ime, name, file->cnt);
+                pthread_mutex_unlock(&vm->files_lock);
+                opened++;
+            }
+        }
+
+        copy_guest(vm, gva + offsetof(struct open_request, fd), &request.fd, sizeof(request.fd), 1);
+    }
+
+    vm->file_batched[0] += opened;
+    return opened;
+}
+
+/**
+ * Stats a batch of files with the STATV operation, looking at the guest's own copy of each file first.
+ *
+ * @param vm Pointer to the guest structure.
+ * @return Number of files found.
+ */
+int statv_op_status(struct guest* vm) {
+    uint64_t gva = vm->file_args[0];
+    int found = 0;
+
+    for (uint32_t i = 0; i < vm->file_args[1] && vm->file_nargs == 2; i++, gva += sizeof(struct stat_request)) {
+        struct stat_request request;
+        if (copy_guest(vm, gva, &request, sizeof(request), 0) < 0) break;
+
+        char name[sizeof(((struct file*)0)->ime)];
+        struct stat st;
+        request.status = 0;
+        if (read_guest_string(vm, request.name, name, sizeof(name)) < 0) {
+            request.status = -ENAMETOOLONG;
+        } else {
+            if (stat_guest_file(vm, name, &st) < 0) request.status = -errno;
+        }
+
+        if (request.status == 0) {
+            request.mode = st.st_mode;
+            request.size = st.st_size;
+            request.mtime_ns = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+            found++;
+        }
+        copy_guest(vm, gva, &request, sizeof(request), 1);
+    }
+
+    vm->file_batched[1] += found;
+    return found;
+}
+
+/**
+ * Lists a directory into a guest buffer with the READDIR operation. In the guest's root directory the
+ * guest's own copies are listed under their names, and the copies of other guests are hidden.
+ *
+ * @param vm Pointer to the guest structure.
+ * @return Number of entries written, 0 at the end of the directory, -1 on failure.
+ */
+int readdir_op_status(struct guest* vm) {
+    char name[sizeof(((struct file*)0)->ime)];
+    if (vm->file_nargs != 4 || read_guest_string(vm, vm->file_args[0], name, sizeof(name)) < 0) return -1;
+
+    uint32_t size = vm->file_args[2], skip = vm->file_args[3];
+    int root = name[0] == '\0' || strcmp(name, ".") == 0;
+    DIR* dir = opendir(root ? "." : name);
+    if (dir == NULL) return -1;
+
+    char* buf = malloc(size);
+    if (buf == NULL) {
+        closedir(dir);
+        return -1;
+    }
+
+    char prefix[32];
+    int prefix_len = snprintf(prefix, sizeof(prefix), "vm_%d_", vm->id);
+    uint32_t used = 0;
+    int count = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        const char* entry_name = entry->d_name;
+        if (strcmp(entry_name, ".") == 0 || strcmp(entry_name, "..") == 0) continue;
+
+        if (root) {
+            size_t digits = strncmp(entry_name, "vm_", 3) == 0 ? strspn(entry_name + 3, "0123456789") : 0;
+            char overlay[300];
+            if (strncmp(entry_name, prefix, prefix_len) == 0) {
+                entry_name += prefix_len; // The guest's own copy
+            } else if (digits > 0 && entry_name[3 + digits] == '_') {
+                continue; // A copy of another guest
+            } else if (snprintf(overlay, sizeof(overlay), "%s%s", prefix, entry_name) < (int)sizeof(overlay) &&
+                       faccessat(dirfd(dir), overlay, F_OK, 0) == 0) {
+                continue; // Shadowed by the guest's own copy
+            }
+        }
+
+        if (skip > 0) {
+            skip--;
+            continue;
+        }
+
+        uint32_t reclen = (offsetof(struct dir_record, name) + strlen(entry_name) + 1 + 7) & ~7U;
+        if (used + reclen > size) break;
+
+        struct dir_record* record = (struct dir_record*)(buf + used);
+        memset(record, 0, reclen);
+        record->reclen = reclen;
+        record->type = entry->d_type;
+        strcpy(record->name, entry_name);
+        used += reclen;
+        count++;
+    }
+    closedir(dir);
+
+    int status = copy_guest(vm, vm->file_args[1], buf, used, 1) < 0 ? -1 : count;
+    free(buf);
+    if (status > 0) vm->file_batched[2] += status;
+    return status;
+}
+
+/**
+ * Performs a batched metadata operation (OPENV, STATV or READDIR) as one request to the host I/O and sends
+ * its result to the guest VM.
+ *
+ * @param vm Pointer to the guest structure.
+ * @return 0 on success.
+ */
+int batch_op_status(struct guest* vm) {
+    int* data = (int*)((char*)vm->kvm_run + vm->kvm_run->io.data_offset);
+
+    io_acquire(vm);
+    if (vm->lock == OPENV) {
+        *data = openv_op_status(vm);
+    } else if (vm->lock == STATV) {
+        *data = statv_op_status(vm);
+    } else {
+        *data = readdir_op_status(vm);
+    }
+    io_release(vm, 0);
+
+    return 0;
+}
+
+int stream_op_status(struct guest* vm);
+int64_t transfer_file(struct guest* vm, struct file* file, uint64_t gva, uint32_t len, int64_t offset, int is_read);
+
+/**
+ * Moves the offset of an open file of the guest VM as one request to the host I/O.
+ *
+ * @param vm Pointer to the guest structure.
+ * @param fd File descriptor of the file.
+ * @param offset The offset, relative to the origin.
+ * @param whence SEEK_SET, SEEK_CUR or SEEK_END.
+ * @return The new offset, a negative errno on failure.
+ */
+int64_t seek_guest_file(struct guest* vm, int fd, int64_t offset, int whence) {
+    struct file* file = pin_file(vm, fd);
+    if (file == NULL) return -EBADF;
+
+    io_acquire(vm);
+    int64_t result = lseek(file->fd, offset, whence);
+    if (result < 0) result = -errno;
+    io_release(vm, 0);
+
+    unpin_file(vm, file, 0);
+    return result;
+}
+
+/**
+ * Handles the PREAD and PWRITE operations, a transfer between a guest buffer and a file at an explicit
+ * offset, and sends the number of bytes transferred to the guest VM. The file offset is left unchanged.
+ *
+ * @param vm Pointer to the guest structure.
+ * @return 0 on success.
+ */
+int positioned_op_status(struct guest* vm) {
+    int64_t offset = (int64_t)((uint64_t)vm->file_args[4] << 32 | vm->file_args[3]);
+    struct file* file = vm->file_nargs == 5 && offset >= 0 ? pin_file(vm, vm->file_args[0]) : NULL;
+
+    int64_t result = -1;
+    if (file) {
+        result = transfer_file(vm, file, vm->file_args[1], vm->file_args[2], offset, vm->lock == PREAD);
+        unpin_file(vm, file, vm->lock == PWRITE && result > 0);
+    }
+
+    *((int*)((char*)vm->kvm_run + vm->kvm_run->io.data_offset)) = result < 0 ? -1 : result;
+    return 0;
+}
+
+/**
+ * Handles the LSEEK operation, moving the offset of a file, and sends the new offset to the guest VM. The
+ * offset is 64-bit, the first read returns its low half and the second read its high half.
+ *
+ * @param vm Pointer to the guest structure.
+ * @return 0 on success.
+ */
+int lseek_op_status(struct guest* vm) {
+    uint32_t* data = (uint32_t*)((char*)vm->kvm_run + vm->kvm_run->io.data_offset);
+
+    if (vm->file_nargs == 4) {
+        int64_t offset = (int64_t)((uint64_t)vm->file_args[2] << 32 | vm->file_args[1]);
+        int64_t result = seek_guest_file(vm, vm->file_args[0], offset, vm->file_args[3]);
+        if (result < 0) result = -1;
+        *data = (uint64_t)result;
+        file_op_arg(vm, (uint64_t)result >> 32); // Keep the high half for the second read
+    } else {
+        *data = vm->file_nargs == 5 ? vm->file_args[4] : UINT32_MAX;
+    }
+
+    return 0;
+}
+
+/**
+ * Performs the current file operation and sends its result to the guest VM. Runs on a worker.
+ *
+ * @param vm Pointer to the guest structure.
+ * @return 0 on success.
+ */
+int file_op_execute(struct guest* vm) {
+    int status = 0;
+
+    if (vm->lock == CLOSE) {
+        status = close_op_status(vm);
+    } else if (vm->lock == COPY) {
+        status = copy_file_op_status(vm);
+    } else if (vm->lock == MAP) {
+        status = map_file_op_status(vm);
+    } else if (vm->lock == READ) {
+        status = read_file_op_status(vm);
+    } else if (vm->lock == STREAM) {
+        status = stream_op_status(vm);
+    } else if (vm->lock == OPENV || vm->lock == STATV || vm->lock == READDIR) {
+        status = batch_op_status(vm);
+    } else if (vm->lock == FSYNC) {
+        status = fsync_op_status(vm);
+    } else if (vm->lock == PREAD || vm->lock == PWRITE) {
+        status = positioned_op_status(vm);
+    } else if (vm->lock == LSEEK) {
+        status = lseek_op_status(vm);
+    }
+
+    return status;
+}
+
+/**
+ * Sends the result of the current file operation to the guest VM. Operations making host system calls are
+ * performed by a worker.
+ *
+ * @param vm Pointer to the guest structure.
+ * @return 0 on success.
+ */
+int file_op_status(struct guest* vm) {
+    if (vm->lock == OPEN) {
+        return opened_file_op_send_fd(vm);
+    } else if (vm->lock == LSEEK && vm->file_nargs == 5) {
+        return lseek_op_status(vm); // The high half of the offset is already known
+    } else if (vm->lock == MAP && vm->file_nargs == 3) {
+        return map_file_op_status(vm); // The size of the file is already known
+    }
+
+    return file_op_offload(vm, file_op_execute);
+}
+
+/**
+ * Handles file operations (open, close, read, write, positioned read and write, seek, copy, map, stream,
+ * fsync and the batched metadata operations) for the guest VM, one step of the current operation per exit.
+ * The steps making host system calls run on a worker, so the vCPU thread never holds the guest's files.
+ *
+ * @param vm Pointer to the guest structure.
+ * @return 0 on success.
+ */
+int handle_file(struct guest* vm) {
+    if (vm->kvm_run->io.direction == KVM_EXIT_IO_OUT && vm->kvm_run->io.size == sizeof(int)) {
+        int data = *((int*)((char*)vm->kvm_run + vm->kvm_run->io.data_offset));
+
+        if (vm->lock == 0) {
+            return start_file_operation(vm, data);
+        } else if (vm->lock == OPEN) {
+            return opened_file_op_flags(vm, data);
+        } else if (vm->file_nargs < file_op_num_args(vm->lock)) {
+            return file_op_arg(vm, data);
+        } else if (data == FINISH) {
+            return end_file_operation(vm);
+        } else {
+            return get_file_descriptor(vm, data);
+        }
+    } else if (vm->kvm_run->io.direction == KVM_EXIT_IO_OUT && vm->kvm_run->io.size == sizeof(char)) {
+        char data = *((char*)vm->kvm_run + vm->kvm_run->io.data_offset);
+        if (vm->lock == OPEN) {
+            return opened_file_op_name(vm, data);
+        } else if (vm->lock == WRITE) {
+            return write_file(vm, data);
+        }
+    } else if (vm->kvm_run->io.direction == KVM_EXIT_IO_IN && vm->kvm_run->io.size == sizeof(int)) {
+        if (vm->lock != 0) return file_op_status(vm);
+    } else if (vm->kvm_run->io.direction == KVM_EXIT_IO_IN && vm->kvm_run->io.size == sizeof(char)) {
+        if (vm->lock == READ) {
+            return read_file(vm);
+        }
+    }
+
+    return 0;
+}
+
+// Devices that complete work through interrupt lines
+enum IrqDevice {
+    IRQ_DEV_CONSOLE,
+    IRQ_DEV_BLK,
+    NUM_IRQ_DEVICES
+};
+
+// Names of the devices, used for the moderation settings and the metrics
+const char* irq_device_names[NUM_IRQ_DEVICES] = { "console", "blk" };
+
+// Structure representing the interrupt moderation settings of a device
+struct irq_moderation {
+    uint32_t coalesce; // Completions signalled by one interrupt
+    uint32_t delay_us; // Longest time a completion waits for others before its interrupt is raised
+};
+
+struct irq_moderation irq_moderation[NUM_IRQ_DEVICES] = { { 1, 0 }, { 1, 0 } };
+
+// Structure representing an interrupt line raised from a host thread through KVM_IRQFD
+struct irq_line {
+    int fd; // eventfd bound to the GSI, -1 if the line is not wired
+    struct irq_moderation moderation; // Moderation settings of the device
+    uint32_t pending; // Completions not signalled yet
+    uint64_t first_pending_ns; // Time of the oldest completion not signalled yet
+    uint64_t raised; // Number of interrupts raised
+    uint64_t completions; // Number of completions signalled
+};
+
+/**
+ * Wires an interrupt line: writes to its eventfd make KVM raise the GSI without stopping the vCPU.
+ *
+ * @param vm Pointer to the guest structure.
+ * @param line Interrupt line to wire.
+ * @param gsi GSI to raise, the PIC IRQ number.
+ * @param device Device owning the line, selects the moderation settings.
+ * @return 0 on success, -1 on failure.
+ */
+int irq_line_init(struct guest* vm, struct irq_line* line, int gsi, enum IrqDevice device) {
+    memset(line, 0, sizeof(struct irq_line));
+    line->moderation = irq_moderation[device];
+
+    line->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (line->fd < 0) {
+        perror("ERROR: Failed to create eventfd\n");
+        return -1;
+    }
+
+    struct kvm_irqfd irqfd = { .fd = line->fd, .gsi = gsi };
+    if (ioctl(vm->vm_fd, KVM_IRQFD, &irqfd) < 0) {
+        perror("ERROR: Failed ioctl KVM_IRQFD\n");
+        fprintf(stderr, "KVM_IRQFD: %s\n", strerror(errno));
+        close(line->fd);
+        line->fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Raises the interrupt for all pending completions.
+ *
+ * @param line Interrupt line.
+ */
+void irq_line_signal(struct irq_line* line) {
+    uint64_t one = 1;
+    write(line->fd, &one, sizeof(one));
+    line->raised++;
+    line->completions += line->pending;
+    line->pending = 0;
+}
+
+/**
+ * Records completed work and raises the interrupt once enough completions are pending. Otherwise the
+ * interrupt is deferred until irq_line_expire finds the oldest completion waited for the moderation delay.
+ *
+ * @param line Interrupt line.
+ * @param count Number of completions.
+ */
+void irq_line_complete(struct irq_line* line, uint32_t count) {
+    if (count == 0) return;
+    if (line->pending == 0) line->first_pending_ns = monotonic_ns();
+    line->pending += count;
+
+    if (line->pending >= line->moderation.coalesce || line->moderation.delay_us == 0) irq_line_signal(line);
+}
+
+/**
+ * Raises the deferred interrupt if the oldest pending completion waited for the moderation delay.
+ *
+ * @param line Interrupt line.
+ * @return Nanoseconds until the deferred interrupt is due, -1 if nothing is pending.
+ */
+int64_t irq_line_expire(struct irq_line* line) {
+    if (line->pending == 0) return -1;
+
+    uint64_t deadline = line->first_pending_ns + line->moderation.delay_us * 1000ULL;
+    uint64_t now = monotonic_ns();
+    if (now >= deadline) {
+        irq_line_signal(line);
+        return -1;
+    }
+
+    return deadline - now;
+}
+
+/**
+ * Waits for events on the given descriptors, waking up in time to raise a deferred interrupt.
+ *
+ * @param line Interrupt line.
+ * @param fds Descriptors to wait on.
+ * @param nfds Number of descriptors.
+ * @return Result of ppoll.
+ */
+int irq_line_poll(struct irq_line* line, struct pollfd* fds, int nfds) {
+    int64_t wait_ns = irq_line_expire(line);
+    struct timespec timeout = { .tv_sec = wait_ns / 1000000000LL, .tv_nsec = wait_ns % 1000000000LL };
+
+    int ret = ppoll(fds, nfds, wait_ns < 0 ? NULL : &timeout, NULL);
+    irq_line_expire(line);
+    return ret;
+}
+
+/**
+ * Parses a moderation setting of the form <device>=<coalesce>/<delay_us>, for example blk=8/50.
+ *
+ * @param arg Setting to parse.
+ * @return 0 on success, -1 if the setting is invalid.
+ */
+int parse_irq_moderation(const char* arg) {
+    char name[16];
+    struct irq_moderation moderation;
+
+    if (sscanf(arg, "%15[^=]=%u/%u", name, &moderation.coalesce, &moderation.delay_us) != 3 || moderation.coalesce == 0) {
+        return -1;
+    }
+
+    for (int i = 0; i < NUM_IRQ_DEVICES; i++) {
+        if (strcmp(name, irq_device_names[i]) == 0) {
+            irq_moderation[i] = moderation;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+// Size of the buffer holding console input not yet read by the guest
+#define CONSOLE_RX_SIZE 4096
+
+// Structure representing the console receiver, which reads the pseudoterminal on its own thread
+struct console {
+    char buf[CONSOLE_RX_SIZE]; // Input not yet read by the guest
+    uint32_t head; // Count of bytes received
+    uint32_t tail; // Count of bytes read by the guest
+    pthread_mutex_t lock; // Lock protecting the buffer
+    pthread_cond_t cond; // Signalled when input arrives, space frees up or the receiver stops
+    int stop_fd; // eventfd written to stop the receiver
+    int stop; // Set once the guest has stopped
+    struct irq_line irq; // Interrupt raised when input arrives
+    pthread_t thread; // Receiver thread
+};
+
+/**
+ * Receives console input into the buffer and raises the console interrupt for it.
+ *
+ * @param arg Pointer to the guest structure.
+ * @return NULL.
+ */
+void* run_console(void* arg) {
+    struct guest* vm = arg;
+    struct console* console = vm->console;
+    struct pollfd fds[2] = { { .fd = console->stop_fd, .events = POLLIN }, { .fd = vm->pty_master, .events = POLLIN } };
+
+    for (;;) {
+        // Wait for room in the buffer before reading more input
+        pthread_mutex_lock(&console->lock);
+        while (console->head - console->tail == CONSOLE_RX_SIZE && !console->stop) {
+            pthread_cond_wait(&console->cond, &console->lock);
+        }
+        uint32_t room = CONSOLE_RX_SIZE - (console->head - console->tail);
+        pthread_mutex_unlock(&console->lock);
+
+        if (irq_line_poll(&console->irq, fds, 2) < 0 && errno != EINTR) break;
+        if (fds[0].revents) break;
+        if (!(fds[1].revents & POLLIN)) continue;
+
+        char input[CONSOLE_RX_SIZE];
+        ssize_t n = read(vm->pty_master, input, room);
+        if (n <= 0) continue;
+
+        pthread_mutex_lock(&console->lock);
+        for (ssize_t i = 0; i < n; i++) {
+            console->buf[console->head++ % CONSOLE_RX_SIZE] = input[i];
+        }
+        pthread_cond_broadcast(&console->cond);
+        pthread_mutex_unlock(&console->lock);
+
+        irq_line_complete(&console->irq, n);
+    }
+
+    return NULL;
+}
+
+/**
+ * Starts the console receiver of the guest VM, so input raises the console interrupt.
+ *
+ * @param vm Pointer to the guest structure.
+ * @return 0 on success, -1 on failure.
+ */
+int init_console(struct guest* vm) {
+    struct console* console = calloc(1, sizeof(struct console));
+    if (console == NULL) return -1;
+
+    pthread_mutex_init(&console->lock, NULL);
+    pthread_cond_init(&console->cond, NULL);
+    console->stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (console->stop_fd < 0 || irq_line_init(vm, &console->irq, CONSOLE_IRQ, IRQ_DEV_CONSOLE) < 0) {
+        free(console);
+        return -1;
+    }
+
+    vm->console = console;
+    if (pthread_create(&console->thread, NULL, &run_console, vm) != 0) {
+        vm->console = NULL;
+        free(console);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Reads a byte of console input, blocking until one arrives or the guest stops.
+ *
+ * @param vm Pointer to the guest structure.
+ * @return The byte read.
+ */
+char console_read(struct guest* vm) {
+    struct console* console = vm->console;
+    char c = 0;
+
+    pthread_mutex_lock(&console->lock);
+    while (console->head == console->tail && !console->stop) {
+        pthread_cond_wait(&console->cond, &console->lock);
+    }
+    if (console->head != console->tail) c = console->buf[console->tail++ % CONSOLE_RX_SIZE];
+    pthread_cond_broadcast(&console->cond);
+    pthread_mutex_unlock(&console->lock);
+
+    return c;
+}
+
+/**
+ * Stops the console receiver once the guest has stopped.
+ *
+ * @param vm Pointer to the guest structure.
+ */
+void stop_console(struct guest* vm) {
+    struct console* console = vm->console;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&console->lock);
+    console->stop = 1;
+    pthread_cond_broadcast(&console->cond);
+    pthread_mutex_unlock(&console->lock);
+
+    write(console->stop_fd, &one, sizeof(one));
+    pthread_join(console->thread, NULL);
+}
+
+// Structure representing a block request in the guest request table
+struct blk_request {
+    uint32_t type; // Request type (BLK_T_IN, BLK_T_OUT or BLK_T_FLUSH)
+    uint32_t status; // Completion status written by the device
+    uint64_t sector; // First sector of the transfer
+    uint64_t addr; // Guest virtual address of the data buffer
+    uint32_t len; // Length of the transfer in bytes, a multiple of the sector size
+    uint32_t reserved;
+};
+
+// Structure representing an entry of the used ring
+struct blk_used {
+    uint32_t id; // Index of the completed request in the request table
+    uint32_t len; // Number of bytes transferred
+};
+
+// Structure representing the request queue shared with the guest, in the layout used by the guest driver
+struct blk_queue {
+    uint32_t size; // Number of entries used in each ring, set by the driver
+    uint32_t avail_idx; // Free-running count of requests made available by the driver
+    uint32_t used_idx; // Free-running count of requests completed by the device
+    uint32_t reserved;
+    uint16_t avail[BLK_QUEUE_MAX]; // Available ring of request table indices
+    struct blk_used used[BLK_QUEUE_MAX]; // Used ring
+    struct blk_request requests[BLK_QUEUE_MAX]; // Request table
+};
+
+// Structure representing the block device of a guest VM
+struct blk_device {
+    int fd; // File descriptor of the backing image
+    uint64_t capacity; // Capacity in sectors
+    uint32_t queue_size; // Queue depth offered to the driver
+    struct blk_queue* queue; // Host pointer to the request queue, NULL until the driver sets it up
+    uint32_t size; // Number of entries used in each ring, fixed at setup since the guest can rewrite the queue
+    uint32_t last_avail; // Available ring position processed so far
+    uint64_t requests; // Number of completed requests
+    uint64_t batches; // Number of host I/O system calls issued for the requests
+    uint64_t doorbells; // Number of doorbells
+    uint64_t bytes_read; // Bytes read from the image
+    uint64_t bytes_written; // Bytes written to the image
+    uint64_t errors; // Requests completed with an error status
+    int async; // Nonzero if an I/O thread serves the doorbells and completions raise an interrupt
+    int doorbell_fd; // ioeventfd signalled by doorbell writes, which then no longer exit
+    int stop; // Set once the guest has stopped
+    pthread_mutex_t lock; // Serializes queue setup by the vCPU thread with the I/O thread processing the queue
+    struct irq_line irq; // Interrupt raised for completed requests
+    pthread_t thread; // I/O thread
+};
+
+// Structure representing the block device configuration shared by all guest VMs
+struct blk_config {
+    const char* path; // Path of the backing image, NULL if no disk is attached
+    int queue_size; // Queue depth of each device
+};
+
+struct blk_config blk_config = { .queue_size = 16 };
+
+void* run_blk_device(void* arg);
+
+/**
+ * Opens the disk image of the guest VM. A single guest uses the image itself, while several guests each get
+ * their own copy of it, named like the guests' output files, so their writes cannot corrupt each other.
+ *
+ * @param vm Pointer to the guest structure.
+ * @return File descriptor of the image, -1 on failure.
+ */
+int open_blk_image(struct guest* vm) {
+    if (num_guests <= 1) return open(blk_config.path, O_RDWR);
+
+    const char* base = strrchr(blk_config.path, '/');
+    char local[200];
+    snprintf(local, sizeof(local), "vm_%d_%s", vm->id, base ? base + 1 : blk_config.path);
+
+    int in = open(blk_config.path, O_RDONLY);
+    if (in < 0) return -1;
+    int fd = open(local, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    struct stat st;
+    if (fd >= 0 && (fstat(in, &st) < 0 || copy_range(in, fd, st.st_size) != st.st_size)) {
+        close(fd);
+        fd = -1;
+    }
+    close(in);
+    return fd;
+}
+
+/**
+ * Attaches the block device to the guest VM by opening the backing image. An asynchronous device serves its
+ * doorbell from an I/O thread woken through KVM_IOEVENTFD and signals completions through KVM_IRQFD.
+ *
+ * @param vm Pointer to the guest structure.
+ * @param async Nonzero to make the device asynchronous, requires an in-kernel irqchip.
+ * @return 0 on success, -1 on failure.
+ */
+int init_blk_device(struct guest* vm, int async) {
+    struct blk_device* blk = calloc(1, sizeof(struct blk_device));
+    if (blk == NULL) return -1;
+
+    blk->fd = open_blk_image(vm);
+    if (blk->fd < 0) {
+        perror("ERROR: Unable to open disk image\n");
+        free(blk);
+        return -1;
+    }
+
+    off_t size = lseek(blk->fd, 0, SEEK_END);
+    blk->capacity = size > 0 ? size / BLK_SECTOR_SIZE : 0;
+    blk->queue_size = blk_config.queue_size;
+    pthread_mutex_init(&blk->lock, NULL);
+    vm->blk = blk;
+
+    if (!async) return 0;
+
+    // Doorbell writes signal the eventfd in the kernel instead of exiting to this process
+    blk->doorbell_fd = eventfd(0, EFD_CLOEXEC);
+    if (blk->doorbell_fd < 0) {
+        perror("ERROR: Failed to create eventfd\n");
+        return -1;
+    }
+
+    struct kvm_ioeventfd ioeventfd = {
+        .addr = BLK_PORT_NOTIFY,
+        .len = 4,
+        .fd = blk->doorbell_fd,
+        .flags = KVM_IOEVENTFD_FLAG_PIO
+    };
+    if (ioctl(vm->vm_fd, KVM_IOEVENTFD, &ioeventfd) < 0) {
+        perror("ERROR: Failed ioctl KVM_IOEVENTFD\n");
+        fprintf(stderr, "KVM_IOEVENTFD: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (irq_line_init(vm, &blk->irq, BLK_IRQ, IRQ_DEV_BLK) < 0) return -1;
+
+    blk->async = 1;
+    if (pthread_create(&blk->thread, NULL, &run_blk_device, vm) != 0) {
+        blk->async = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Sets up the request queue at the guest virtual address written by the driver.
+ * The queue must be physically contiguous, which holds for the linear mappings built by setup_long_mode.
+ *
+ * @param vm Pointer to the guest structure.
+ * @param gva Guest virtual address of the queue.
+ * @return 0 on success, -1 if the queue is not mapped.
+ */
+int blk_setup_queue(struct guest* vm, uint64_t gva) {
+    struct blk_device* blk = vm->blk;
+    int64_t start = guest_virt_to_phys(vm, gva);
+    int64_t end = guest_virt_to_phys(vm, gva + sizeof(struct blk_queue) - 1);
+    int ret = 0;
+
+    // The I/O thread of an asynchronous device may be processing the current queue
+    pthread_mutex_lock(&blk->lock);
+    if (start < 0 || end - start != sizeof(struct blk_queue) - 1) {
+        fprintf(stderr, "VM %d: invalid block queue address 0x%" PRIx64 "\n", vm->id, gva);
+        blk->queue = NULL;
+        ret = -1;
+    } else {
+        blk->queue = guest_phys_to_host(vm, start, sizeof(struct blk_queue));
+        blk->size = blk->queue->size;
+        if (blk->size == 0 || blk->size > blk->queue_size) blk->size = blk->queue_size;
+        blk->queue->size = blk->size; // Tell the driver the size in use
+        blk->last_avail = blk->queue->avail_idx;
+    }
+    pthread_mutex_unlock(&blk->lock);
+
+    return ret;
+}
+
+/**
+ * Builds the I/O vector for a guest buffer, translating it page by page.
+ *
+ * @param vm Pointer to the guest structure.
+ * @param gva Guest virtual address of the buffer.
+ * @param len Length of the buffer in bytes.
+ * @param iov I/O vector receiving the host segments.
+ * @param max Capacity of the I/O vector.
+ * @return Number of segments used, -1 if the buffer is not mapped or does not fit.
+ */
+int blk_map_buffer(struct guest* vm, uint64_t gva, uint32_t len, struct iovec* iov, int max) {
+    int count = 0;
+
+    while (len > 0) {
+        uint32_t chunk = PAGE_SIZE - (gva & (PAGE_SIZE - 1));
+        if (chunk > len) chunk = len;
+
+        int64_t gpa = guest_virt_to_phys(vm, gva);
+        void* host = gpa < 0 ? NULL : guest_phys_to_host(vm, gpa, chunk);
+        if (host == NULL) return -1;
+
+        // Merge segments that are contiguous on the host
+        if (count > 0 && (char*)iov[count - 1].iov_base + iov[count - 1].iov_len == host) {
+            iov[count - 1].iov_len += chunk;
+        } else {
+            if (count == max) return -1;
+            iov[count].iov_base = host;
+            iov[count].iov_len = chunk;
+            count++;
+        }
+
+        gva += chunk;
+        len -= chunk;
+    }
+
+    return count;
+}
+
+/**
+ * Completes a request by setting its status and adding it to the used ring.
+ *
+ * @param blk Pointer to the block device.
+ * @param id Index of the request in the request table.
+ * @param status Completion status.
+ * @param len Number of bytes transferred.
+ */
+void blk_complete(struct blk_device* blk, uint32_t id, uint32_t status, uint32_t len) {
+    struct blk_queue* queue = blk->queue;
+
+    queue->requests[id].status = status;
+    queue->used[queue->used_idx % blk->size].id = id;
+    queue->used[queue->used_idx % blk->size].len = len;
+
+    // Publish the used entry only after the status and the data are visible
+    __atomic_store_n(&queue->used_idx, queue->used_idx + 1, __ATOMIC_RELEASE);
+
+    blk->requests++;
+    if (status != BLK_S_OK) blk->errors++;
+}
+
+/**
+ * Processes all requests made available by the driver. Consecutive reads or writes of adjacent sectors
+ * are merged into a single preadv or pwritev call.
+ *
+ * @param vm Pointer to the guest structure.
+ */
+void blk_process_queue(struct guest* vm) {
+    struct blk_device* blk = vm->blk;
+    struct blk_queue* queue = blk->queue;
+    uint32_t avail_idx = __atomic_load_n(&queue->avail_idx, __ATOMIC_ACQUIRE);
+    struct iovec iov[BLK_MAX_SEGMENTS];
+
+    // A driver cannot have more requests outstanding than the ring holds, skip the ones it overwrote
+    if (avail_idx - blk->last_avail > blk->size) blk->last_avail = avail_idx - blk->size;
+
+    while (blk->last_avail != avail_idx) {
+        uint32_t ids[BLK_QUEUE_MAX]; // Requests merged into the current batch
+        uint32_t num_ids = 0;
+        int num_iov = 0;
+        uint64_t sector = 0, next_sector = 0;
+        uint32_t type = 0, bytes = 0;
+
+        // Gather a batch of requests of the same type covering adjacent sectors
+        while (blk->last_avail != avail_idx && num_ids < blk->size) {
+            uint32_t id = queue->avail[blk->last_avail % blk->size];
+            if (id >= blk->size) {
+                blk->last_avail++;
+                continue;
+            }
+            struct blk_request* request = &queue->requests[id];
+
+            if (request->type == BLK_T_FLUSH || (request->type != BLK_T_IN && request->type != BLK_T_OUT)) {
+                if (num_ids > 0) break; // Finish the current batch first
+                blk->last_avail++;
+                if (request->type == BLK_T_FLUSH) {
+                    blk->batches++;
+                    int status = BLK_S_OK;
+                    if (vm->io->durability != DURABILITY_NONE && commit_sync(vm, blk->fd) < 0) status = BLK_S_IOERR;
+                    blk_complete(blk, id, status, 0);
+                } else {
+                    blk_complete(blk, id, BLK_S_UNSUPP, 0);
+                }
+                continue;
+            }
+
+            if (num_ids > 0 && (request->type != type || request->sector != next_sector)) break;
+
+            // Reject requests that are unaligned or run past the end of the disk
+            int segments = -1;
+            if (request->len % BLK_SECTOR_SIZE == 0 && request->sector <= blk->capacity &&
+                request->len / BLK_SECTOR_SIZE <= blk->capacity - request->sector) {
+                segments = blk_map_buffer(vm, request->addr, request->len, &iov[num_iov], BLK_MAX_SEGMENTS - num_iov);
+            }
+            if (segments < 0) {
+                if (num_ids > 0) break;
+                blk->last_avail++;
+                blk_complete(blk, id, BLK_S_IOERR, 0);
+                continue;
+            }
+
+            if (num_ids == 0) {
+                type = request->type;
+                sector = request->sector;
+            }
+            num_iov += segments;
+            next_sector = request->sector + request->len / BLK_SECTOR_SIZE;
+            bytes += request->len;
+            ids[num_ids++] = id;
+            blk->last_avail++;
+        }
+
+        if (num_ids == 0) continue;
+
+        // Transfer the whole batch with one system call
+        ssize_t done;
+        io_throttle(vm);
+        io_acquire(vm);
+        if (type == BLK_T_IN) {
+            done = preadv(blk->fd, iov, num_iov, sector * BLK_SECTOR_SIZE);
+            if (done > 0) blk->bytes_read += done;
+        } else {
+            done = pwritev(blk->fd, iov, num_iov, sector * BLK_SECTOR_SIZE);
+            if (done > 0) blk->bytes_written += done;
+        }
+        io_release(vm, done > 0 ? done : 0);
+        blk->batches++;
+
+        uint32_t status = done == bytes ? BLK_S_OK : BLK_S_IOERR;
+        for (uint32_t i = 0; i < num_ids; i++) {
+            blk_complete(blk, ids[i], status, status == BLK_S_OK ? queue->requests[ids[i]].len : 0);
+        }
+    }
+}
+
+/**
+ * Serves the doorbells of an asynchronous block device and raises the completion interrupt.
+ *
+ * @param arg Pointer to the guest structure.
+ * @return NULL.
+ */
+void* run_blk_device(void* arg) {
+    struct guest* vm = arg;
+    struct blk_device* blk = vm->blk;
+    struct pollfd fd = { .fd = blk->doorbell_fd, .events = POLLIN };
+
+    for (;;) {
+        if (irq_line_poll(&blk->irq, &fd, 1) < 0 && errno != EINTR) break;
+        if (!(fd.revents & POLLIN)) continue;
+
+        // The eventfd counts the doorbells rung since the last read
+        uint64_t count;
+        if (read(blk->doorbell_fd, &count, sizeof(count)) != sizeof(count)) continue;
+        if (__atomic_load_n(&blk->stop, __ATOMIC_ACQUIRE)) break;
+        blk->doorbells += count;
+
+        pthread_mutex_lock(&blk->lock);
+        uint64_t completed = blk->requests;
+        if (blk->queue) blk_process_queue(vm);
+        completed = blk->requests - completed;
+        pthread_mutex_unlock(&blk->lock);
+        irq_line_complete(&blk->irq, completed);
+    }
+
+    return NULL;
+}
+
+/**
+ * Stops the I/O thread of an asynchronous block device once the guest has stopped.
+ *
+ * @param vm Pointer to the guest structure.
+ */
+void stop_blk_device(struct guest* vm) {
+    uint64_t one = 1;
+
+    __atomic_store_n(&vm->blk->stop, 1, __ATOMIC_RELEASE);
+    write(vm->blk->doorbell_fd, &one, sizeof(one));
+    pthread_join(vm->blk->thread, NULL);
+}
+
+/**
+ * Handles accesses to the block device ports: queue setup, the doorbell and the capacity register.
+ *
+ * @param vm Pointer to the guest structure.
+ * @return 0 on success.
+ */
+int handle_blk(struct guest* vm) {
+    struct blk_device* blk = vm->blk;
+    uint32_t* data = (uint32_t*)((char*)vm->kvm_run + vm->kvm_run->io.data_offset);
+
+    if (vm->kvm_run->io.direction == KVM_EXIT_IO_IN) {
+        // Without a disk the device reads as absent
+        if (vm->kvm_run->io.port == BLK_PORT_CAPACITY) {
+            *data = blk ? blk->capacity : 0;
+        } else if (vm->kvm_run->io.port == BLK_PORT_QUEUE) {
+            *data = blk ? blk->queue_size : 0;
+        } else {
+            *data = 0;
+        }
+        return 0;
+    }
+
+    if (blk == NULL) return 0;
+
+    if (vm->kvm_run->io.port == BLK_PORT_QUEUE) {
+        blk_setup_queue(vm, *data);
+    } else if (vm->kvm_run->io.port == BLK_PORT_NOTIFY && blk->queue) {
+        blk->doorbells++;
+        blk_process_queue(vm);
+    }
+
+    return 0;
+}
+
+// Control block of a stream in guest memory, shared with the guest
+struct stream_control {
+    uint64_t buffers[2]; // Guest addresses of the two buffers
+    uint32_t size; // Capacity of each buffer in bytes
+    volatile uint32_t len[2]; // Number of bytes in each buffer, written by the host
+    volatile uint32_t state[2]; // STREAM_EMPTY, STREAM_FULL, STREAM_END or STREAM_ERROR for each buffer
+};
+
+// Structure representing a streaming read: a host thread fills one guest buffer while the guest consumes the other
+struct stream {
+    struct guest* vm; // Guest VM reading the stream
+    int fd; // Duplicate of the file descriptor, sharing its offset
+    struct stream_control* control; // Control block in guest memory
+    struct iovec iov[2][STREAM_BUFFER_MAX / PAGE_SIZE + 1]; // Host segments of the buffers
+    int iovcnt[2]; // Number of segments of each buffer
+    pthread_t thread; // Thread filling the buffers
+    pthread_mutex_t lock; // Protects the buffer states against lost wakeups
+    pthread_cond_t cond; // Signaled when a buffer changes state
+    int stop; // Set to stop the thread
+    int done; // Set once the thread has published the end of the file, an error or stopped
+    uint64_t bytes; // Bytes read into the buffers
+    uint64_t fills; // Buffers filled
+    uint64_t waits; // Times the guest waited for a buffer
+    off_t dropped; // Offset up to which cached pages behind the stream were dropped
+    uint64_t dropped_bytes; // Cached bytes dropped behind the stream
+};
+
+/**
+ * Reads the file into the buffers of a stream, alternating between them. A buffer is filled as soon as the
+ * guest releases it, and is filled completely unless the file ends, so its length is explicit.
+ *
+ * @param arg Pointer to the stream.
+ * @return NULL on completion.
+ */
+void* run_stream(void* arg) {
+    struct stream* stream = arg;
+    struct stream_control* control = stream->control;
+
+    for (int slot = 0;; slot ^= 1) {
+        // Wait for the guest to release the buffer
+        pthread_mutex_lock(&stream->lock);
+        while (!stream->stop && control->state[slot] != STREAM_EMPTY) {
+            pthread_cond_wait(&stream->cond, &stream->lock);
+        }
+        int stop = stream->stop;
+        pthread_mutex_unlock(&stream->lock);
+        if (stop) break;
+
+        // Fill the buffer, continuing after short reads
+        io_throttle(stream->vm);
+        io_acquire(stream->vm);
+        struct iovec iov[STREAM_BUFFER_MAX / PAGE_SIZE + 1];
+        int iovcnt = stream->iovcnt[slot];
+        memcpy(iov, stream->iov[slot], iovcnt * sizeof(struct iovec));
+        struct iovec* next = iov;
+        uint32_t len = 0;
+        ssize_t n = 0;
+        while (iovcnt > 0 && (n = readv(stream->fd, next, iovcnt)) > 0) {
+            len += n;
+            while (iovcnt > 0 && (size_t)n >= next->iov_len) {
+                n -= next->iov_len;
+                next++;
+                iovcnt--;
+            }
+            if (iovcnt > 0) {
+                next->iov_base = (char*)next->iov_base + n;
+                next->iov_len -= n;
+            }
+        }
+        io_release(stream->vm, len);
+        if (len > 0) {
+            // A stream reads its file once, do not keep it in the page cache
+            off_t offset = file_offset(stream->fd);
+            if (offset >= 0) stream->dropped_bytes += access_drop_behind(stream->fd, &stream->dropped, offset);
+        }
+        if (len == 0 && iovcnt > 0 && n < 0 && errno == EINTR) {
+            slot ^= 1; // Retry the same buffer
+            continue;
+        }
+
+        // Publish the length before the state
+        uint32_t state = len > 0 ? STREAM_FULL : n < 0 ? STREAM_ERROR : STREAM_END;
+        control->len[slot] = len;
+        pthread_mutex_lock(&stream->lock);
+        __atomic_store_n(&control->state[slot], state, __ATOMIC_RELEASE);
+        stream->bytes += len;
+        stream->fills += len > 0;
+        pthread_cond_broadcast(&stream->cond);
+        pthread_mutex_unlock(&stream->lock);
+        if (state != STREAM_FULL) break;
+    }
+
+    // No buffer will be filled anymore, release a guest waiting for one
+    pthread_mutex_lock(&stream->lock);
+    stream->done = 1;
+    pthread_cond_broadcast(&stream->cond);
+    pthread_mutex_unlock(&stream->lock);
+
+    return NULL;
+}
+
+/**
+ * Starts a stream for the STREAM operation and sends its id to the guest VM. The guest fills the control
+ * block with the addresses and size of its buffers and marks both empty before starting the stream.
+ *
+ * @param vm Pointer to the guest structure.
+ * @return 0 on success.
+ */
+int stream_op_status(struct guest* vm) {
+    int* data = (int*)((char*)vm->kvm_run + vm->kvm_run->io.data_offset);
+    *data = -1;
+
+    int id = 0;
+    while (id < MAX_STREAMS && vm->streams[id]) id++;
+    if (id == MAX_STREAMS || vm->file_nargs != 2) return 0;
+
+    // The control block must not cross a page so it is contiguous on the host
+    uint64_t gva = vm->file_args[1];
+    if ((gva & (PAGE_SIZE - 1)) + sizeof(struct stream_control) > PAGE_SIZE) return 0;
+    int64_t gpa = guest_virt_to_phys(vm, gva);
+    struct stream_control* control = gpa < 0 ? NULL : guest_phys_to_host(vm, gpa, sizeof(struct stream_control));
+    if (control == NULL || control->size == 0 || control->size > STREAM_BUFFER_MAX) return 0;
+
+    struct stream* stream = calloc(1, sizeof(struct stream));
+    if (stream == NULL) {
+        perror("ERROR: Failed to allocate stream\n");
+        return 0;
+    }
+    stream->vm = vm;
+    stream->control = control;
+    for (int i = 0; i < 2; i++) {
+        stream->iovcnt[i] = blk_map_buffer(vm, control->buffers[i], control->size, stream->iov[i], STREAM_BUFFER_MAX / PAGE_SIZE + 1);
+        if (stream->iovcnt[i] < 0) {
+            free(stream);
+            return 0;
+        }
+        control->state[i] = STREAM_EMPTY;
+    }
+
+    // The stream reads its own descriptor, closing the file does not wait for it
+    struct file* file = pin_file(vm, vm->file_args[0]);
+    stream->fd = file ? dup(file->fd) : -1;
+    if (file) unpin_file(vm, file, 0);
+    if (stream->fd < 0) {
+        if (file) perror("ERROR: Failed to dup stream file\n");
+        free(stream);
+        return 0;
+    }
+    posix_fadvise(stream->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    stream->dropped = file_offset(stream->fd);
+    if (stream->dropped < 0) stream->dropped = 0;
+    pthread_mutex_init(&stream->lock, NULL);
+    pthread_cond_init(&stream->cond, NULL);
+    if (pthread_create(&stream->thread, NULL, run_stream, stream) != 0) {
+        perror("ERROR: Failed to create stream thread\n");
+        close(stream->fd);
+        free(stream);
+        return 0;
+    }
+
+    vm->streams[id] = stream;
+    *data = id;
+    return 0;
+}
+
+/**
+ * Stops the thread of a stream, adds its counters to the guest VM and frees it.
+ *
+ * @param vm Pointer to the guest structure.
+ * @param id Id of the stream.
+ */
+void stop_stream(struct guest* vm, int id) {
+    struct stream* stream = vm->streams[id];
+
+    pthread_mutex_lock(&stream->lock);
+    stream->stop = 1;
+    pthread_cond_broadcast(&stream->cond);
+    pthread_mutex_unlock(&stream->lock);
+    pthread_join(stream->thread, NULL);
+
+    vm->stream_bytes += stream->bytes;
+    vm->stream_fills += stream->fills;
+    vm->stream_waits += stream->waits;
+    __atomic_fetch_add(&vm->access_dropped_bytes, stream->dropped_bytes, __ATOMIC_RELAXED);
+    close(stream->fd);
+    pthread_mutex_destroy(&stream->lock);
+    pthread_cond_destroy(&stream->cond);
+    free(stream);
+    vm->streams[id] = NULL;
+}
+
+/**
+ * Handles accesses to the stream ports. Each write carries the stream id times two plus the buffer index,
+ * except for closing, which carries the stream id. Releasing hands an empty buffer back to the host, and
+ * waiting blocks the guest until the host has filled a buffer or reached the end of the file. Waiting in the
+ * middle of a file operation returns at once.
+ *
+ * @param vm Pointer to the guest structure.
+ * @return 0 on success.
+ */
+int handle_stream(struct guest* vm) {
+    if (vm->kvm_run->io.direction != KVM_EXIT_IO_OUT || vm->kvm_run->io.size != sizeof(uint32_t)) return 0;
+    uint32_t data = *(uint32_t*)((char*)vm->kvm_run + vm->kvm_run->io.data_offset);
+
+    if (vm->kvm_run->io.port == STREAM_PORT_CLOSE) {
+        if (data < MAX_STREAMS && vm->streams[data]) stop_stream(vm, data);
+        return 0;
+    }
+
+    uint32_t id = data / 2, slot = data % 2;
+    if (id >= MAX_STREAMS || vm->streams[id] == NULL) return 0;
+    struct stream* stream = vm->streams[id];
+
+    pthread_mutex_lock(&stream->lock);
+    if (vm->kvm_run->io.port == STREAM_PORT_RELEASE) {
+        pthread_cond_broadcast(&stream->cond);
+    } else if (vm->kvm_run->io.port == STREAM_PORT_WAIT && vm->lock == 0 && !stream->done && stream->control->state[slot] == STREAM_EMPTY) {
+        // Like for the file ring, the guest only blocks between file operations
+        stream->waits++;
+        while (!stream->done && stream->control->state[slot] == STREAM_EMPTY) {
+            pthread_cond_wait(&stream->cond, &stream->lock);
+        }
+    }
+    pthread_mutex_unlock(&stream->lock);
+
+    return 0;
+}
+
+// Submission of a file request, in the layout used by the guest runtime
+struct file_sqe {
+    uint32_t op; // OPEN, CLOSE, READ, WRITE, LSEEK, COPY or FSYNC
+    int32_t fd; // File descriptor, the source file of a copy
+    uint64_t addr; // Guest address of the file name or the data buffer
+    uint32_t len; // Length of the transfer, the mode of an open
+    uint32_t flags; // Flags of an open, the destination file of a copy, the origin of a seek
+    int64_t offset; // File offset of a read or write, -1 for the current offset, the offset of a seek
+    uint64_t user_data; // Value returned in the completion
+};
+
+// Completion of a file request
+struct file_cqe {
+    uint64_t user_data; // Value of the submission
+    int64_t result; // Result of the request, a negative errno on failure
+};
+
+// Structure representing the file ring shared with the guest. Both rings use free-running indices, the guest
+// writes sq_tail and cq_head and the host writes sq_head and cq_tail.
+struct file_ring {
+    uint32_t size; // Number of entries used in each ring, set by the guest
+    uint32_t sq_tail; // Count of requests submitted by the guest
+    uint32_t sq_head; // Count of submissions the host has taken, their entries may be reused
+    uint32_t cq_tail; // Count of requests completed by the host
+    uint32_t cq_head; // Count of completions consumed by the guest
+    uint32_t reserved[3];
+    struct file_sqe sq[FILE_RING_MAX]; // Submission ring
+    struct file_cqe cq[FILE_RING_MAX]; // Completion ring
+};
+
+// Request taken from the submission ring, waiting for or being executed by a worker
+struct file_work {
+    struct file_sqe sqe; // Copy of the submission, the guest may reuse its entry
+    int (*step)(struct guest*); // Step of a file operation the vCPU waits for, NULL for ring requests
+    uint64_t queued_ns; // Time the request was queued
+    struct file_work* next; // Next request in the queue or the free list
+};
+
+// Structure representing the queue of file requests of a guest VM
+struct file_queue {
+    struct file_ring* ring; // Host pointer to the file ring, NULL until the guest sets it up
+    uint32_t size; // Number of entries used in each ring, fixed at setup since the guest can rewrite the ring
+    uint32_t last_sq; // Submission ring position taken so far
+    uint32_t cq_tail; // Count of completions posted, only published to the ring
+    pthread_mutex_t lock; // Protects the queue, the completion ring and the counters
+    pthread_cond_t cond; // Signaled when a request completes
+    struct file_work work[FILE_RING_MAX]; // One work item per request in flight
+    struct file_work* free; // Unused work items
+    struct file_work* head; // Requests waiting for a worker, in submission order
+    struct file_work** tail; // Append pointer of the queue
+    uint32_t depth; // Number of requests waiting for a worker
+    uint32_t peak_depth; // Largest number of requests waiting for a worker
+    uint32_t inflight; // Number of requests taken and not completed yet
+    uint64_t doorbells; // Number of doorbells
+    uint64_t submitted; // Number of requests taken from the submission ring
+    uint64_t completed; // Number of requests completed
+    uint64_t stolen; // Requests executed by a worker serving another guest first
+    uint64_t wait_ns; // Time requests waited for a worker
+    uint64_t max_wait_ns; // Longest wait of a request for a worker
+    uint64_t waits; // Times the guest waited for a completion
+    struct file_work step_work; // Work item of the file operation step the vCPU waits for
+    int step_done; // Set once the step has run
+    int step_status; // Result of the step
+};
+
+// Workers executing the file requests of all guest VMs. Worker i serves guest i modulo the number of guests
+// first and takes requests of the other guests when its own has none.
+struct worker_pool {
+    int size; // Number of workers
+    pthread_t threads[FILE_WORKERS_MAX]; // Worker threads
+    int started; // Set once the workers are running
+    int stop; // Set to stop the workers once no guest can submit requests
+    pthread_mutex_t lock; // Protects the pool
+    pthread_cond_t cond; // Signaled when requests are queued
+    uint32_t pending; // Requests queued for all guests
+};
+
+struct worker_pool worker_pool = { .size = 2, .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+/**
+ * Allocates the request queue of a guest VM.
+ *
+ * @param vm Pointer to the guest structure.
+ * @return 0 on success, -1 on failure.
+ */
+int init_file_queue(struct guest* vm) {
+    struct file_queue* queue = calloc(1, sizeof(struct file_queue));
+    if (queue == NULL) {
+        perror("ERROR: Failed to allocate file queue\n");
+        return -1;
+    }
+
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->cond, NULL);
+    queue->tail = &queue->head;
+    for (int i = 0; i < FILE_RING_MAX; i++) {
+        queue->work[i].next = queue->free;
+        queue->free = &queue->work[i];
+    }
+
+    vm->file_queue = queue;
+    return 0;
+}
+
+/**
+ * Opens a file for an OPEN request as one request to the host I/O and adds it to the file list.
+ *
+ * @param vm Pointer to the guest structure.
+ * @param sqe The request.
+ * @return File descriptor, a negative errno on failure.
+ */
+int64_t file_work_open(struct guest* vm, struct file_sqe* sqe) {
+    char name[sizeof(((struct file*)0)->ime)];
+    if (read_guest_string(vm, sqe->addr, name, sizeof(name)) < 0) return -EFAULT;
+
+    struct file* file = init_file();
+    strcpy(file->ime, name);
+    file->cnt = strlen(name) + 1;
+    file->flags = sqe->flags;
+    file->mode = sqe->len;
+    io_acquire(vm);
+    file->fd = open_guest_file(vm, name, file->flags, file->mode);
+    int error = errno;
+    io_release(vm, 0);
+    if (file->fd < 0) {
+        free_file(file);
+        return -error;
+    }
+    file->dirty = (file->flags & O_TRUNC) != 0;
+
+    pthread_mutex_lock(&vm->files_lock);
+    link_file(vm, file);
+    pthread_mutex_unlock(&vm->files_lock);
+
+    return file->fd;
+}
+
+/**
+ * Reads or writes a guest buffer at the current offset of a file or at an explicit offset, at most
+ * FILE_RING_IO_MAX bytes at once, as one request to the host I/O. The caller has pinned the file.
+ *
+ * @param vm Pointer to the guest structure.
+ * @param file The file.
+ * @param gva Guest virtual address of the buffer.
+ * @param len Length of the buffer.
+ * @param offset File offset, -1 for the current offset.
+ * @param is_read Nonzero to read into the buffer, zero to write it.
+ * @return Number of bytes transferred, a negative errno on failure.
+ */
+int64_t transfer_file(struct guest* vm, struct file* file, uint64_t gva, uint32_t len, int64_t offset, int is_read) {
+    struct iovec iov[FILE_RING_IO_MAX / PAGE_SIZE + 1];
+    if (len > FILE_RING_IO_MAX) len = FILE_RING_IO_MAX;
+    int iovcnt = blk_map_buffer(vm, gva, len, iov, FILE_RING_IO_MAX / PAGE_SIZE + 1);
+    if (iovcnt < 0) return -EFAULT;
+
+    io_acquire(vm);
+    off_t start = offset >= 0 ? offset : file_offset(file->fd);
+    ssize_t done;
+    if (offset >= 0) {
+        done = is_read ? preadv(file->fd, iov, iovcnt, offset) : pwritev(file->fd, iov, iovcnt, offset);
+    } else {
+        done = is_read ? readv(file->fd, iov, iovcnt) : writev(file->fd, iov, iovcnt);
+    }
+    int error = errno;
+    io_release(vm, done > 0 ? done : 0);
+    if (done < 0) return -error;
+
+    // Positioned requests tell the classifier where random and strided accesses go
+    if (done > 0 && start >= 0) access_record(vm, file, start, done, is_read);
+    return done;
+}
+
+/**
+ * Executes a file request of a guest VM. The guest's files are only locked to look up and pin the files
+ * the request uses and the host I/O is only held while its system calls run, so the requests of a guest
+ * overlap.
+ *
+ * @param vm Pointer to the guest structure.
+ * @param sqe The request.
+ * @return Result of the request, a negative errno on failure.
+ */
+int64_t file_work_execute(struct guest* vm, struct file_sqe* sqe) {
+    if (sqe->op == OPEN) {
+        return file_work_open(vm, sqe);
+    } else if (sqe->op == READ || sqe->op == WRITE) {
+        struct file* file = pin_file(vm, sqe->fd);
+        if (file == NULL) return -EBADF;
+        int64_t result = transfer_file(vm, file, sqe->addr, sqe->len, sqe->offset, sqe->op == READ);
+        unpin_file(vm, file, sqe->op == WRITE && result > 0);
+        return result;
+    } else if (sqe->op == LSEEK) {
+        return seek_guest_file(vm, sqe->fd, sqe->offset, sqe->flags);
+    } else if (sqe->op == CLOSE) {
+        return close_guest_file(vm, sqe->fd);
+    } else if (sqe->op == FSYNC) {
+        return sync_guest_file(vm, sqe->fd);
+    } else if (sqe->op == COPY) {
+        return copy_files(vm, sqe->fd, sqe->flags, sqe->len);
+    }
+
+    return -EINVAL;
+}
+
+/**
+ * Posts the completion of a request to the completion ring and wakes the guest if it is waiting.
+ *
+ * @param queue Queue of the guest VM.
+ * @param work The completed request.
+ * @param result Result of the request.
+ */
+void file_work_complete(struct file_queue* queue, struct file_work* work, int64_t result) {
+    struct file_ring* ring = queue->ring;
+
+    pthread_mutex_lock(&queue->lock);
+    struct file_cqe* cqe = &ring->cq[queue->cq_tail % queue->size];
+    cqe->user_data = work->sqe.user_data;
+    cqe->result = result;
+
+    // Publish the completion only after the result and the data are visible
+    __atomic_store_n(&ring->cq_tail, ++queue->cq_tail, __ATOMIC_RELEASE);
+    queue->inflight--;
+    queue->completed++;
+    work->next = queue->free;
+    queue->free = work;
+    pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * Runs a worker: takes queued requests, from its own guest first, executes them and posts their completions.
+ * A step of a file operation is run and handed back to the vCPU waiting for it instead.
+ *
+ * @param arg Index of the worker.
+ * @return NULL once the pool is stopped.
+ */
+void* run_file_worker(void* arg) {
+    int home = (int)(intptr_t)arg % num_guests;
+
+    for (;;) {
+        pthread_mutex_lock(&worker_pool.lock);
+        while (!worker_pool.stop && worker_pool.pending == 0) {
+            pthread_cond_wait(&worker_pool.cond, &worker_pool.lock);
+        }
+        if (worker_pool.pending == 0) {
+            pthread_mutex_unlock(&worker_pool.lock);
+            break;
+        }
+        worker_pool.pending--;
+        pthread_mutex_unlock(&worker_pool.lock);
+
+        // A request is queued for each pending count, so one is found
+        struct guest* vm = NULL;
+        struct file_work* work = NULL;
+        for (int i = 0; i < num_guests && work == NULL; i++) {
+            vm = guests[(home + i) % num_guests];
+            struct file_queue* queue = vm->file_queue;
+
+            pthread_mutex_lock(&queue->lock);
+            work = queue->head;
+            if (work) {
+                queue->head = work->next;
+                if (queue->head == NULL) queue->tail = &queue->head;
+                queue->depth--;
+                queue->stolen += i > 0;
+                uint64_t wait = monotonic_ns() - work->queued_ns;
+                queue->wait_ns += wait;
+                if (wait > queue->max_wait_ns) queue->max_wait_ns = wait;
+            }
+            pthread_mutex_unlock(&queue->lock);
+        }
+        if (work == NULL) continue;
+
+        // Throttle the guest before the request pins any file
+        io_throttle(vm);
+        if (work->step) {
+            struct file_queue* queue = vm->file_queue;
+            int status = work->step(vm);
+            pthread_mutex_lock(&queue->lock);
+            queue->step_status = status;
+            queue->step_done = 1;
+            pthread_cond_broadcast(&queue->cond);
+            pthread_mutex_unlock(&queue->lock);
+            continue;
+        }
+
+        int64_t result = file_work_execute(vm, &work->sqe);
+        file_work_complete(vm->file_queue, work, result);
+    }
+
+    return NULL;
+}
+
+/**
+ * Starts the workers on the first ring set up or file operation of a guest.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int start_file_workers() {
+    int status = 0;
+
+    pthread_mutex_lock(&worker_pool.lock);
+    if (worker_pool.started == 0) {
+        for (int i = 0; i < worker_pool.size; i++) {
+            if (pthread_create(&worker_pool.threads[i], NULL, run_file_worker, (void*)(intptr_t)i) != 0) {
+                perror("ERROR: Failed to create file worker\n");
+                break;
+            }
+            worker_pool.started++;
+        }
+        if (worker_pool.started == 0) status = -1;
+    }
+    pthread_mutex_unlock(&worker_pool.lock);
+
+    return status;
+}
+
+/**
+ * Runs a step of a file operation of the guest VM on a worker and waits for it, so the vCPU thread neither
+ * blocks in host system calls nor waits for the guest's files. The step is queued behind the guest's ring
+ * requests. It runs on the vCPU thread if no worker can be started.
+ *
+ * @param vm Pointer to the guest structure.
+ * @param step The step.
+ * @return Result of the step.
+ */
+int file_op_offload(struct guest* vm, int (*step)(struct guest*)) {
+    struct file_queue* queue = vm->file_queue;
+    if (start_file_workers() < 0) {
+        io_throttle(vm);
+        return step(vm);
+    }
+
+    pthread_mutex_lock(&queue->lock);
+    struct file_work* work = &queue->step_work;
+    work->step = step;
+    work->queued_ns = monotonic_ns();
+    work->next = NULL;
+    *queue->tail = work;
+    queue->tail = &work->next;
+    queue->depth++;
+    if (queue->depth > queue->peak_depth) queue->peak_depth = queue->depth;
+    queue->step_done = 0;
+    pthread_mutex_unlock(&queue->lock);
+
+    pthread_mutex_lock(&worker_pool.lock);
+    worker_pool.pending++;
+    pthread_cond_broadcast(&worker_pool.cond);
+    pthread_mutex_unlock(&worker_pool.lock);
+
+    pthread_mutex_lock(&queue->lock);
+    while (!queue->step_done) {
+        pthread_cond_wait(&queue->cond, &queue->lock);
+    }
+    int status = queue->step_status;
+    pthread_mutex_unlock(&queue->lock);
+
+    return status;
+}
+
+/**
+ * Stops the workers once no guest can submit requests.
+ */
+void stop_file_workers() {
+    pthread_mutex_lock(&worker_pool.lock);
+    worker_pool.stop = 1;
+    pthread_cond_broadcast(&worker_pool.cond);
+    pthread_mutex_unlock(&worker_pool.lock);
+
+    for (int i = 0; i < worker_pool.started; i++) {
+        pthread_join(worker_pool.threads[i], NULL);
+    }
+}
+
+/**
+ * Sets up the file ring at the guest virtual address written by the guest.
+ * The ring must be physically contiguous, which holds for the linear mappings built by setup_long_mode.
+ *
+ * @param vm Pointer to the guest structure.
+ * @param gva Guest virtual address of the ring.
+ * @return 0 on success, -1 if the ring is not mapped or requests are still in flight.
+ */
+int file_ring_setup(struct guest* vm, uint64_t gva) {
+    struct file_queue* queue = vm->file_queue;
+    int64_t start = guest_virt_to_phys(vm, gva);
+    int64_t end = guest_virt_to_phys(vm, gva + sizeof(struct file_ring) - 1);
+
+    if (start < 0 || end - start != sizeof(struct file_ring) - 1) {
+        fprintf(stderr, "VM %d: invalid file ring address 0x%" PRIx64 "\n", vm->id, gva);
+        return -1;
+    }
+    if (start_file_workers() < 0) return -1;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->inflight > 0) {
+        pthread_mutex_unlock(&queue->lock);
+        return -1;
+    }
+    queue->ring = guest_phys_to_host(vm, start, sizeof(struct file_ring));
+    queue->size = queue->ring->size;
+    if (queue->size == 0 || queue->size > FILE_RING_MAX) queue->size = FILE_RING_MAX;
+    queue->ring->size = queue->size; // Tell the guest the size in use
+    queue->last_sq = queue->ring->sq_tail;
+    queue->cq_tail = queue->ring->cq_tail;
+    pthread_mutex_unlock(&queue->lock);
+
+    return 0;
+}
+
+/**
+ * Takes the requests submitted by the guest and queues them for the workers. Requests are only taken while
+ * their completions are sure to fit in the completion ring and a work item is free, the others are taken
+ * once the guest has consumed completions and notifies or waits again.
+ *
+ * @param vm Pointer to the guest structure.
+ */
+void file_ring_submit(struct guest* vm) {
+    struct file_queue* queue = vm->file_queue;
+    struct file_ring* ring = queue->ring;
+    uint32_t count = 0;
+
+    pthread_mutex_lock(&queue->lock);
+    uint32_t sq_tail = __atomic_load_n(&ring->sq_tail, __ATOMIC_ACQUIRE);
+    uint32_t cq_head = __atomic_load_n(&ring->cq_head, __ATOMIC_ACQUIRE);
+    uint64_t now = monotonic_ns();
+    while (queue->last_sq != sq_tail && queue->inflight + (queue->cq_tail - cq_head) < queue->size && queue->free) {
+        struct file_work* work = queue->free;
+        queue->free = work->next;
+        work->sqe = ring->sq[queue->last_sq % queue->size];
+        work->queued_ns = now;
+        work->next = NULL;
+        *queue->tail = work;
+        queue->tail = &work->next;
+        queue->last_sq++;
+        queue->depth++;
+        queue->inflight++;
+        count++;
+    }
+    if (queue->depth > queue->peak_depth) queue->peak_depth = queue->depth;
+    queue->submitted += count;
+    __atomic_store_n(&ring->sq_head, queue->last_sq, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&queue->lock);
+
+    if (count == 0) return;
+    pthread_mutex_lock(&worker_pool.lock);
+    worker_pool.pending += count;
+    pthread_cond_broadcast(&worker_pool.cond);
+    pthread_mutex_unlock(&worker_pool.lock);
+}
+
+/**
+ * Waits until the guest has completions to consume or no request is in flight.
+ *
+ * @param vm Pointer to the guest structure.
+ * @return Number of completions not consumed yet.
+ */
+uint32_t file_ring_wait(struct guest* vm) {
+    struct file_queue* queue = vm->file_queue;
+    struct file_ring* ring = queue->ring;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->cq_tail == ring->cq_head && queue->inflight > 0) queue->waits++;
+    while (queue->cq_tail == __atomic_load_n(&ring->cq_head, __ATOMIC_ACQUIRE) && queue->inflight > 0) {
+        pthread_cond_wait(&queue->cond, &queue->lock);
+    }
+    uint32_t ready = queue->cq_tail - ring->cq_head;
+    pthread_mutex_unlock(&queue->lock);
+
+    // The guest may have moved cq_head anywhere, it never has more completions than the ring holds
+    return ready < queue->size ? ready : queue->size;
+}
+
+/**
+ * Waits for the requests of a guest VM still in flight once it has stopped.
+ *
+ * @param vm Pointer to the guest structure.
+ */
+void drain_file_queue(struct guest* vm) {
+    struct file_queue* queue = vm->file_queue;
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->inflight > 0) {
+        pthread_cond_wait(&queue->cond, &queue->lock);
+    }
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * Handles accesses to the file ring ports. Reading the setup port returns the number of workers, writing it
+ * sets up the ring. Writing the notify port submits the new requests, reading it also submits them and then
+ * blocks the guest until a completion is ready, returning the number of completions to consume. The vCPU
+ * only queues requests, the workers execute them.
+ *
+ * @param vm Pointer to the guest structure.
+ * @return 0 on success.
+ */
+int handle_file_ring(struct guest* vm) {
+    struct file_queue* queue = vm->file_queue;
+    uint32_t* data = (uint32_t*)((char*)vm->kvm_run + vm->kvm_run->io.data_offset);
+
+    if (vm->kvm_run->io.port == FILE_RING_PORT_SETUP) {
+        if (vm->kvm_run->io.direction == KVM_EXIT_IO_IN) {
+            *data = worker_pool.size;
+        } else {
+            file_ring_setup(vm, *data);
+        }
+        return 0;
+    }
+
+    if (vm->kvm_run->io.port != FILE_RING_PORT_NOTIFY || queue->ring == NULL) {
+        if (vm->kvm_run->io.direction == KVM_EXIT_IO_IN) *data = 0;
+        return 0;
+    }
+
+    file_ring_submit(vm);
+    if (vm->kvm_run->io.direction == KVM_EXIT_IO_OUT) {
+        queue->doorbells++;
+    } else {
+        // The guest only blocks between file operations, never in the middle of one
+        *data = vm->lock == 0 ? file_ring_wait(vm) : 0;
+    }
+
+    return 0;
+}
+
+// Structure representing the memory shared by all guest VMs
+struct shared_memory {
+    char* mem; // Host mapping of the shared memory, NULL if disabled
+    uint64_t size; // Size of the shared memory, a multiple of 2MB
+};
+
+struct shared_memory shared_memory;
+
+// Lock and condition variable used by guests waiting for a doorbell
+pthread_mutex_t doorbell_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t doorbell_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Allocates the memory shared by all guest VMs.
+ *
+ * @param size Requested size in bytes, rounded up to a multiple of 2MB.
+ * @return 0 on success, -1 on failure.
+ */
+int create_shared_memory(uint64_t size) {
+    shared_memory.size = (size + SIZE2MB - 1) / SIZE2MB * SIZE2MB;
+    shared_memory.mem = mmap(NULL, shared_memory.size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared_memory.mem == MAP_FAILED) {
+        perror("ERROR: Failed to mmap shared memory\n");
+        shared_memory.mem = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Finds a running guest VM by its ID.
+ *
+ * @param id ID of the guest VM.
+ * @return Pointer to the guest structure, NULL if there is no such guest.
+ */
+struct guest* find_guest(int id) {
+    for (int i = 0; i < num_guests; i++) {
+        if (guests[i] && guests[i]->id == id) return guests[i];
+    }
+    return NULL;
+}
+
+/**
+ * Counts the guest VMs that are still running, other than the given one.
+ *
+ * @param vm Pointer to the guest structure to leave out.
+ * @return Number of other running guest VMs.
+ */
+int other_running_guests(struct guest* vm) {
+    int count = 0;
+    for (int i = 0; i < num_guests; i++) {
+        if (guests[i] && guests[i] != vm && guests[i]->running) count++;
+    }
+    return count;
+}
+
+/**
+ * Rings the doorbell of a guest VM, waking it if it is waiting.
+ *
+ * @param id ID of the guest VM to notify.
+ * @return 0 on success, -1 if there is no such guest.
+ */
+int ring_doorbell(int id) {
+    struct guest* target = find_guest(id);
+    if (target == NULL) return -1;
+
+    pthread_mutex_lock(&doorbell_lock);
+    target->doorbells++;
+    pthread_cond_broadcast(&doorbell_cond);
+    pthread_mutex_unlock(&doorbell_lock);
+
+    return 0;
+}
+
+/**
+ * Blocks the vCPU until a doorbell is rung for the guest VM. Returns immediately if a doorbell is already
+ * pending, or when no other guest is left to ring it.
+ *
+ * @param vm Pointer to the guest structure.
+ * @return Total number of doorbells rung for the guest.
+ */
+uint32_t wait_doorbell(struct guest* vm) {
+    pthread_mutex_lock(&doorbell_lock);
+    while (vm->doorbells == vm->doorbells_seen && other_running_guests(vm) > 0) {
+        pthread_cond_wait(&doorbell_cond, &doorbell_lock);
+    }
+    vm->doorbells_seen = vm->doorbells;
+    pthread_mutex_unlock(&doorbell_lock);
+
+    return vm->doorbells_seen;
+}
+
+/**
+ * Handles accesses to the shared memory ports: the window address and size, the guest ID and the doorbell.
+ *
+ * @param vm Pointer to the guest structure.
+ * @return 0 on success.
+ */
+int handle_shm(struct guest* vm) {
+    uint32_t* data = (uint32_t*)((char*)vm->kvm_run + vm->kvm_run->io.data_offset);
+
+    if (vm->kvm_run->io.direction == KVM_EXIT_IO_OUT) {
+        if (vm->kvm_run->io.port == SHM_PORT_DOORBELL) ring_doorbell(*data);
+        return 0;
+    }
+
+    switch (vm->kvm_run->io.port) {
+        case SHM_PORT_ADDR:
+            *data = vm->shm_addr;
+            break;
+        case SHM_PORT_SIZE:
+            *data = vm->shm_addr ? shared_memory.size : 0;
+            break;
+        case SHM_PORT_DOORBELL:
+            *data = wait_doorbell(vm);
+            break;
+        case SHM_PORT_ID:
+            *data = vm->id;
+            break;
+    }
+
+    return 0;
+}
+
+// Structure representing a message, as laid out in the guest rings
+struct msg {
+    uint32_t peer; // Destination ID when sending, source ID when receiving
+    uint32_t len; // Length of the payload in bytes
+    uint8_t data[MSG_DATA_MAX]; // Payload
+};
+
+// Structure representing a single-producer single-consumer ring of messages in guest memory
+struct msg_ring {
+    uint32_t head; // Count of messages produced
+    uint32_t tail; // Count of messages consumed
+    uint32_t reserved[14];
+    struct msg entries[MSG_RING_SIZE]; // Ring entries
+};
+
+// Structure representing the message queue shared with the message device
+struct msg_queue {
+    struct msg_ring tx; // Messages sent by the guest, consumed by the device
+    struct msg_ring rx; // Messages delivered by the device, consumed by the guest
+};
+
+// Structure representing a message in flight between guest VMs
+struct msg_node {
+    struct msg_node* next; // Next message in the mailbox
+    uint64_t sent_ns; // Time the message left the sender's ring
+    struct msg msg; // The message, with the peer set to the source ID
+};
+
+// Structure representing the delivery counters of messages from one source guest
+struct msg_pair {
+    uint64_t messages; // Number of messages delivered
+    uint64_t bytes; // Number of payload bytes delivered
+    uint64_t latency_ns; // Sum of the send to delivery latencies
+    uint64_t max_latency_ns; // Largest send to delivery latency
+};
+
+// Structure representing the message device of a guest VM
+struct msg_device {
+    struct msg_node* head __attribute__((aligned(64))); // Last pushed message, exchanged by the senders
+    struct msg_node* tail __attribute__((aligned(64))); // Next message to deliver, owned by the receiver
+    struct msg_node stub; // Placeholder keeping the mailbox non-empty
+    struct msg_queue* queue; // Host pointer to the message queue, NULL until the guest sets it up
+    sem_t wake; // Posted to wake the receiver when it waits for messages
+    int waiting; // Set while the receiver waits for messages
+    uint64_t sent; // Number of messages routed from this guest
+    uint64_t dropped; // Number of messages addressed to unknown guests or too long
+    uint64_t overflows; // Number of messages dropped because the destination's mailbox was full
+    uint32_t queued; // Number of messages waiting in the mailbox, at most MSG_MAILBOX_MAX
+    uint64_t wakeups; // Number of times senders woke this guest
+    struct msg_pair* pairs; // Delivery counters indexed by the source ID
+};
+
+/**
+ * Initializes the message device of a guest VM with an empty mailbox.
+ *
+ * @param vm Pointer to the guest structure.
+ * @return 0 on success, -1 on failure.
+ */
+int init_msg_device(struct guest* vm) {
+    struct msg_device* dev;
+    if (posix_memalign((void**)&dev, 64, sizeof(struct msg_device)) != 0) return -1;
+    memset(dev, 0, sizeof(struct msg_device));
+
+    dev->pairs = calloc(num_guests, sizeof(struct msg_pair));
+    if (dev->pairs == NULL || sem_init(&dev->wake, 0, 0) < 0) {
+        perror("ERROR: Failed to initialize message device\n");
+        free(dev->pairs);
+        free(dev);
+        return -1;
+    }
+
+    dev->head = &dev->stub;
+    dev->tail = &dev->stub;
+    vm->msg = dev;
+
+    return 0;
+}
+
+/**
+ * Pushes a message into a mailbox. Safe to call from any number of threads at once.
+ *
+ * @param dev Message device owning the mailbox.
+ * @param node Message to push.
+ */
+void msg_push(struct msg_device* dev, struct msg_node* node) {
+    node->next = NULL;
+    struct msg_node* prev = __atomic_exchange_n(&dev->head, node, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+}
+
+/**
+ * Pops the oldest message from a mailbox. Only the receiving guest's thread may call it.
+ * A push that has not linked its message yet makes the mailbox look empty; the sender wakes the receiver
+ * once the push completes.
+ *
+ * @param dev Message device owning the mailbox.
+ * @return The message, NULL if the mailbox is empty.
+ */
+struct msg_node* msg_pop(struct msg_device* dev) {
+    struct msg_node* tail = dev->tail;
+    struct msg_node* next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    // Skip the stub
+    if (tail == &dev->stub) {
+        if (next == NULL) return NULL;
+        dev->tail = next;
+        tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+
+    if (next) {
+        dev->tail = next;
+        return tail;
+    }
+
+    // The last message can only be taken once the stub is queued behind it
+    if (tail != __atomic_load_n(&dev->head, __ATOMIC_ACQUIRE)) return NULL;
+    msg_push(dev, &dev->stub);
+
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next) {
+        dev->tail = next;
+        return tail;
+    }
+
+    return NULL;
+}
+
+/**
+ * Wakes the receiving guest if it waits for messages.
+ *
+ * @param vm Pointer to the receiving guest structure.
+ */
+void msg_wake(struct guest* vm) {
+    if (__atomic_exchange_n(&vm->msg->waiting, 0, __ATOMIC_SEQ_CST)) {
+        __atomic_fetch_add(&vm->msg->wakeups, 1, __ATOMIC_RELAXED);
+        sem_post(&vm->msg->wake);
+    }
+}
+
+/**
+ * Sets up the message queue at the guest virtual address written by the guest.
+ *
+ * @param vm Pointer to the guest structure.
+ * @param gva Guest virtual address of the queue.
+ * @return 0 on success, -1 if the queue is not mapped.
+ */
+int msg_setup_queue(struct guest* vm, uint64_t gva) {
+    int64_t start = guest_virt_to_phys(vm, gva);
+    int64_t end = guest_virt_to_phys(vm, gva + sizeof(struct msg_queue) - 1);
+
+    if (start < 0 || end - start != sizeof(struct msg_queue) - 1) {
+        fprintf(stderr, "VM %d: invalid message queue address 0x%" PRIx64 "\n", vm->id, gva);
+        vm->msg->queue = NULL;
+        return -1;
+    }
+
+    vm->msg->queue = guest_phys_to_host(vm, start, sizeof(struct msg_queue));
+    return 0;
+}
+
+/**
+ * Routes the messages in the guest's send ring to the mailboxes of their destinations. A mailbox holds at
+ * most MSG_MAILBOX_MAX messages, so a receiver that stops reading cannot make its senders grow host memory;
+ * messages to a full mailbox are dropped and counted.
+ *
+ * @param vm Pointer to the sending guest structure.
+ */
+void msg_send(struct guest* vm) {
+    struct msg_ring* tx = &vm->msg->queue->tx;
+    uint32_t head = __atomic_load_n(&tx->head, __ATOMIC_ACQUIRE);
+    uint32_t tail = tx->tail;
+
+    // The ring holds at most MSG_RING_SIZE messages, whatever the indices written by the guest say
+    if (head - tail > MSG_RING_SIZE) tail = head - MSG_RING_SIZE;
+
+    for (; tail != head; tail++) {
+        struct msg* msg = &tx->entries[tail % MSG_RING_SIZE];
+        struct guest* target = find_guest(msg->peer);
+        struct msg_node* node;
+
+        if (target == NULL || msg->len > MSG_DATA_MAX) {
+            vm->msg->dropped++;
+            continue;
+        }
+
+        // Reserve a place in the destination's mailbox
+        if (__atomic_fetch_add(&target->msg->queued, 1, __ATOMIC_RELAXED) >= MSG_MAILBOX_MAX) {
+            __atomic_fetch_sub(&target->msg->queued, 1, __ATOMIC_RELAXED);
+            vm->msg->overflows++;
+            continue;
+        }
+
+        if ((node = malloc(sizeof(struct msg_node))) == NULL) {
+            __atomic_fetch_sub(&target->msg->queued, 1, __ATOMIC_RELAXED);
+            vm->msg->dropped++;
+            continue;
+        }
+
+        node->msg.peer = vm->id;
+        node->msg.len = msg->len;
+        memcpy(node->msg.data, msg->data, msg->len);
+        node->sent_ns = monotonic_ns();
+
+        msg_push(target->msg, node);
+        msg_wake(target);
+        vm->msg->sent++;
+    }
+
+    // Hand the consumed entries back to the guest
+    __atomic_store_n(&tx->tail, tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * Moves messages from the guest's mailbox into its receive ring while the ring has room.
+ *
+ * @param vm Pointer to the receiving guest structure.
+ * @return Number of messages delivered.
+ */
+int msg_deliver(struct guest* vm) {
+    struct msg_device* dev = vm->msg;
+    struct msg_ring* rx = &dev->queue->rx;
+    uint32_t head = rx->head;
+    int delivered = 0;
+
+    while (head - __atomic_load_n(&rx->tail, __ATOMIC_ACQUIRE) < MSG_RING_SIZE) {
+        struct msg_node* node = msg_pop(dev);
+        if (node == NULL) break;
+        __atomic_fetch_sub(&dev->queued, 1, __ATOMIC_RELAXED);
+
+        rx->entries[head % MSG_RING_SIZE] = node->msg;
+        head++;
+        delivered++;
+
+        // Account the message to its source
+        uint64_t latency = monotonic_ns() - node->sent_ns;
+        struct msg_pair* pair = &dev->pairs[node->msg.peer];
+        pair->messages++;
+        pair->bytes += node->msg.len;
+        pair->latency_ns += latency;
+        if (latency > pair->max_latency_ns) pair->max_latency_ns = latency;
+
+        free(node);
+    }
+
+    __atomic_store_n(&rx->head, head, __ATOMIC_RELEASE);
+    return delivered;
+}
+
+/**
+ * Delivers pending messages to the guest, blocking the vCPU until one arrives if the receive ring is empty.
+ * Returns without waiting when no other guest is left to send a message.
+ *
+ * @param vm Pointer to the receiving guest structure.
+ * @return Number of messages in the receive ring.
+ */
+uint32_t msg_receive(struct guest* vm) {
+    struct msg_device* dev = vm->msg;
+    struct msg_ring* rx = &dev->queue->rx;
+
+    for (;;) {
+        msg_deliver(vm);
+        if (rx->head != __atomic_load_n(&rx->tail, __ATOMIC_ACQUIRE)) break;
+
+        // Announce the wait, then check again so a message pushed meanwhile is not missed
+        __atomic_store_n(&dev->waiting, 1, __ATOMIC_SEQ_CST);
+        if (msg_deliver(vm) > 0 || other_running_guests(vm) == 0) {
+            // Consume the wakeup if a sender already cleared the flag
+            if (__atomic_exchange_n(&dev->waiting, 0, __ATOMIC_SEQ_CST) == 0) {
+                while (sem_wait(&dev->wake) < 0 && errno == EINTR);
+            }
+            break;
+        }
+
+        while (sem_wait(&dev->wake) < 0 && errno == EINTR);
+    }
+
+    return rx->head - __atomic_load_n(&rx->tail, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Handles accesses to the message device ports. Writing the queue port sets up the message queue, writing
+ * the notify port sends the queued messages, and reading it receives messages.
+ *
+ * @param vm Pointer to the guest structure.
+ * @return 0 on success.
+ */
+int handle_msg(struct guest* vm) {
+    uint32_t* data = (uint32_t*)((char*)vm->kvm_run + vm->kvm_run->io.data_offset);
+
+    if (vm->kvm_run->io.direction == KVM_EXIT_IO_OUT) {
+        if (vm->kvm_run->io.port == MSG_PORT_QUEUE) {
+            msg_setup_queue(vm, *data);
+        } else if (vm->kvm_run->io.port == MSG_PORT_NOTIFY && vm->msg->queue) {
+            msg_send(vm);
+        }
+        return 0;
+    }
+
+    if (vm->kvm_run->io.port == MSG_PORT_NOTIFY && vm->msg->queue) {
+        *data = msg_receive(vm);
+    } else {
+        *data = 0;
+    }
+
+    return 0;
+}
+
+/**
+ * Handles IO exits for the guest VM, including pseudoterminal communication and file operations.
+ *
+ * @param vm Pointer to the guest structure.
+ * @return 0 on success, -1 on failure.
+ */
+int exit_io(struct guest* vm) {
+    if (vm->kvm_run->io.direction == KVM_EXIT_IO_OUT && vm->kvm_run->io.port == 0xE9) {
+        // A string instruction (rep outsb) hands over count bytes at once
+        char* data = (char*)vm->kvm_run + vm->kvm_run->io.data_offset;
+        write(vm->pty_master, data, vm->kvm_run->io.size * vm->kvm_run->io.count);
+        return 0;
+    } else if (vm->kvm_run->io.direction == KVM_EXIT_IO_IN && vm->kvm_run->io.port == 0xE9) {
+        char c;
+        if (vm->console) {
+            c = console_read(vm); // Input was received by the console thread
+        } else {
+            read(vm->pty_master, &c, sizeof(char));
+        }
+        *((char*)vm->kvm_run + vm->kvm_run->io.data_offset) = c;
+        return 0;
+    } else if (vm->kvm_run->io.port == 0x278) {
+        handle_file(vm); // Its result is the value returned to the guest, not an exit status
+        return 0;
+    } else if (vm->kvm_run->io.port >= BLK_PORT_QUEUE && vm->kvm_run->io.port <= BLK_PORT_CAPACITY + 3) {
+        return handle_blk(vm);
+    } else if (vm->kvm_run->io.port >= SHM_PORT_ADDR && vm->kvm_run->io.port <= SHM_PORT_ID + 3) {
+        return handle_shm(vm);
+    } else if (vm->kvm_run->io.port >= MSG_PORT_QUEUE && vm->kvm_run->io.port <= MSG_PORT_NOTIFY + 3) {
+        return handle_msg(vm);
+    } else if (vm->kvm_run->io.port == 0x20 || vm->kvm_run->io.port == 0x21 || vm->kvm_run->io.port == 0xA0 ||
+               vm->kvm_run->io.port == 0xA1 || (vm->kvm_run->io.port >= 0x40 && vm->kvm_run->io.port <= 0x43)) {
+        // The PIC and PIT are only emulated with --irqchip, without it they are absent and reads float high
+        if (vm->kvm_run->io.direction == KVM_EXIT_IO_IN) {
+            memset((char*)vm->kvm_run + vm->kvm_run->io.data_offset, 0xFF, vm->kvm_run->io.size * vm->kvm_run->io.count);
+        }
+        return 0;
+    } else if (vm->kvm_run->io.port >= STREAM_PORT_RELEASE && vm->kvm_run->io.port <= STREAM_PORT_CLOSE + 3) {
+        return handle_stream(vm);
+    } else if (vm->kvm_run->io.port >= FILE_RING_PORT_SETUP && vm->kvm_run->io.port <= FILE_RING_PORT_NOTIFY + 3) {
+        return handle_file_ring(vm);
+    } else if (vm->kvm_run->io.port == MEM_PORT_SIZE && vm->kvm_run->io.direction == KVM_EXIT_IO_IN) {
+        // Everything from the first page up to the end of the memory is mapped by setup_long_mode
+        *(uint32_t*)((char*)vm->kvm_run + vm->kvm_run->io.data_offset) = vm->mem_size - vm->starting_address;
+        return 0;
+    } else if (vm->kvm_run->io.port == EXIT_PORT) {
+        // With an in-kernel irqchip HLT no longer exits, so guests exit through this port
+        printf("VM %d exit\n", vm->id);
+        return 1;
+    } else {
+        fprintf(stderr, "Invalid port %d\n", vm->kvm_run->io.port);
+        return -1;
+    }
+}
+
+/**
+ * Handles internal errors for the guest VM.
+ *
+ * @param vm Pointer to the guest structure.
+ * @return -1 to indicate an error.
+ */
+int exit_internal_error(struct guest* vm) {
+    printf("ERROR: Internal error: suberror = 0x%x\n", vm->kvm_run->internal.suberror);
+    return -1;
+}
+
+/**
+ * Handles shutdown exits for the guest VM.
+ *
+ * @param vm Pointer to the guest structure.
+ * @return 1 to indicate the VM should stop running.
+ */
+int exit_shutdown(struct guest* vm) {
+    printf("Shutdown\n");
+    return 1;
+}
+
+// Typedef for the exit handlers
+typedef int (*Handler)(struct guest* vm);
+
+// Array of exit handlers
+static Handler handlers[] = {
+    NULL, NULL, &exit_io, NULL, NULL, &exit_halt,
+    NULL, NULL, &exit_shutdown, NULL, NULL,
+    NULL, NULL, NULL, NULL, NULL, NULL,
+    &exit_internal_error
+};
+
+// Structure representing a function symbol of the guest image
+struct symbol {
+    uint64_t addr; // Address of the function in the guest image
+    uint64_t size; // Size of the function in bytes
+    char* name; // Name of the function
+};
+
+// Structure representing a call stack collected by the profiler
+struct profile_stack {
+    uint64_t frames[PROFILE_MAX_DEPTH]; // Frames, innermost first
+    int depth; // Number of frames
+    uint64_t count; // Number of samples with this call stack
+    struct profile_stack* next; // Pointer to the next stack in the bucket
+};
+
+// Structure representing the samples collected for one guest VM
+struct profile {
+    struct profile_stack* buckets[PROFILE_BUCKETS]; // Hash table of collected call stacks
+    uint64_t samples; // Total number of samples
+    uint64_t lost; // Samples that could not read the guest registers
+};
+
+// Structure representing the sampling profiler shared by all guest VMs
+struct profiler {
+    int hz; // Sampling frequency, 0 if profiling is disabled
+    int depth; // Maximum number of frames walked per sample
+    const char* out_path; // Path of the folded stacks output file
+    struct symbol* symbols; // Function symbols sorted by address
+    int num_symbols; // Number of function symbols
+    volatile int stop; // Set to stop the sampling thread
+};
+
+// Profiler state; the lock orders kicks against vCPU threads finishing
+struct profiler profiler = { .depth = PROFILE_MAX_DEPTH, .out_path = "profile.folded" };
+pthread_mutex_t profiler_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Set by the profiler signal when the vCPU thread should take a sample
+static __thread volatile sig_atomic_t sample_pending;
+
+/**
+ * Signal handler used to kick a vCPU thread out of KVM_RUN.
+ *
+ * @param sig Signal number.
+ */
+void profile_signal(int sig) {
+    (void)sig;
+    sample_pending = 1;
+}
+
+/**
+ * Compares two symbols by address, used for sorting the symbol table.
+ *
+ * @param a Pointer to the first symbol.
+ * @param b Pointer to the second symbol.
+ * @return Negative, zero or positive value as in qsort.
+ */
+int compare_symbols(const void* a, const void* b) {
+    const struct symbol* x = a;
+    const struct symbol* y = b;
+    return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+/**
+ * Loads the function symbols of the guest from an ELF file. Linked images use the symbol values directly,
+ * while for a relocatable object (guest.o) the .start and .text sections are laid out as guest.ld does.
+ *
+ * @param path Path to the ELF file.
+ * @return 0 on success, -1 on failure.
+ */
+int load_symbols(const char* path) {
+    FILE* f = fopen(path, "r");
+    if (f == NULL) {
+        perror("ERROR: Unable to open symbol file\n");
+        return -1;
+    }
+
+    // Read the whole ELF file into memory
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char* data = malloc(size);
+    if (data == NULL || fread(data, 1, size, f) != (size_t)size) {
+        fprintf(stderr, "ERROR: Unable to read symbol file %s\n", path);
+        fclose(f);
+        free(data);
+        return -1;
+    }
+    fclose(f);
+
+    Elf64_Ehdr* ehdr = (Elf64_Ehdr*)data;
+    if (size < (long)sizeof(Elf64_Ehdr) || memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 || ehdr->e_ident[EI_CLASS] != ELFCLASS64) {
+        fprintf(stderr, "ERROR: %s is not a 64-bit ELF file\n", path);
+        free(data);
+        return -1;
+    }
+
+    Elf64_Shdr* shdrs = (Elf64_Shdr*)(data + ehdr->e_shoff);
+    const char* shstrtab = data + shdrs[ehdr->e_shstrndx].sh_offset;
+
+    // Compute the image address of each section, -1 for sections that hold no code
+    int64_t* base = malloc(sizeof(int64_t) * ehdr->e_shnum);
+    for (int i = 0; i < ehdr->e_shnum; i++) {
+        base[i] = ehdr->e_type == ET_REL ? -1 : 0;
+    }
+    if (ehdr->e_type == ET_REL) {
+        uint64_t addr = 0;
+        const char* order[] = {".start", ".text"}; // Output order from guest.ld
+        for (int k = 0; k < 2; k++) {
+            for (int i = 0; i < ehdr->e_shnum; i++) {
+                const char* name = shstrtab + shdrs[i].sh_name;
+                if (!(shdrs[i].sh_flags & SHF_ALLOC) || strncmp(name, order[k], strlen(order[k])) != 0) continue;
+                if (k == 0 && strcmp(name, ".start") != 0) continue;
 
+                uint64_t align = shdrs[i].sh_addralign ? shdrs[i].sh_addralign : 1;
+                addr = (addr + align - 1) / align * align;
+                base[i] = addr;
+                addr += shdrs[i].sh_size;
+            }
+        }
+    }
+
+    // Collect the function symbols from the symbol table
+    for (int i = 0; i < ehdr->e_shnum; i++) {
+        if (shdrs[i].sh_type != SHT_SYMTAB) continue;
+
+        Elf64_Sym* syms = (Elf64_Sym*)(data + shdrs[i].sh_offset);
+        const char* strtab = data + shdrs[shdrs[i].sh_link].sh_offset;
+        int count = shdrs[i].sh_size / sizeof(Elf64_Sym);
+
+        profiler.symbols = realloc(profiler.symbols, sizeof(struct symbol) * (profiler.num_symbols + count));
+        for (int j = 0; j < count; j++) {
+            if (ELF64_ST_TYPE(syms[j].st_info) != STT_FUNC) continue;
+            if (syms[j].st_shndx == SHN_UNDEF || syms[j].st_shndx >= ehdr->e_shnum) continue;
+            if (base[syms[j].st_shndx] < 0) continue;
+
+            struct symbol* sym = &profiler.symbols[profiler.num_symbols++];
+            sym->addr = base[syms[j].st_shndx] + syms[j].st_value;
+            sym->size = syms[j].st_size;
+            sym->name = strdup(strtab + syms[j].st_name);
+        }
+    }
+
+    qsort(profiler.symbols, profiler.num_symbols, sizeof(struct symbol), compare_symbols);
+
+    free(base);
+    free(data);
     return 0;
 }
 
 /**
- * Handles closing a file and updating the file list.
+ * Finds the function symbol containing an address.
  *
- * @param vm Pointer to the guest structure.
- * @return 0 on success.
+ * @param addr Address in the guest image.
+ * @return Pointer to the symbol, NULL if no symbol contains the address.
  */
-int close_op_status(struct guest* vm) {
-    int status;
-    if (vm->current_file == NULL) status = -1;
-    else status = close(vm->current_file->fd);
+struct symbol* find_symbol(uint64_t addr) {
+    int lo = 0, hi = profiler.num_symbols - 1;
+    struct symbol* found = NULL;
 
-    // Remove the file from the file list
-    for (struct file** indirect = &vm->file_head; *indirect; indirect = &(*indirect)->next) {
-        if (*indirect == vm->current_file) {
-            *indirect = vm->current_file->next;
-            break;
+    // Binary search for the last symbol starting at or before the address
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (profiler.symbols[mid].addr <= addr) {
+            found = &profiler.symbols[mid];
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
         }
     }
 
-    // Free the file structure
-    free(vm->current_file);
-    *((int*)((char*)vm->kvm_run + vm->kvm_run->io.data_offset)) = status;
-
-    return 0;
+    if (found && found->size && addr >= found->addr + found->size) return NULL;
+    return found;
 }
 
 /**
- * Reads a character from a file and sends it to the guest VM.
+ * Records a sample of the guest call stack. The stack is walked through the saved frame pointers.
  *
  * @param vm Pointer to the guest structure.
- * @return 0 on success.
  */
-int read_file(struct guest* vm) {
-    if (vm->current_file == NULL) {
-        *((char*)vm->kvm_run + vm->kvm_run->io.data_offset) = EOF;
-        return 0;
+void profile_sample(struct guest* vm) {
+    struct kvm_regs regs;
+    struct profile_stack stack;
+
+    if (ioctl(vm->vm_vcpu, KVM_GET_REGS, &regs) < 0) {
+        vm->profile->lost++;
+        return;
     }
 
-    char c;
-    int status = read(vm->current_file->fd, &c, 1);
-    *((char*)vm->kvm_run + vm->kvm_run->io.data_offset) = status == 1 ? c : EOF;
+    // The innermost frame is the current instruction, callers are found through the return addresses
+    uint64_t pc = regs.rip;
+    uint64_t fp = regs.rbp;
+    stack.depth = 0;
+    while (stack.depth < profiler.depth) {
+        struct symbol* sym = find_symbol(pc);
+        stack.frames[stack.depth++] = sym ? sym->addr : pc; // Aggregate by function when symbols are known
 
-    return 0;
+        uint64_t next_fp, ret;
+        if (fp == 0 || read_guest_u64(vm, fp, &next_fp) < 0 || read_guest_u64(vm, fp + 8, &ret) < 0) break;
+        if (ret == 0 || next_fp <= fp) break; // Stop at the outermost frame or a corrupted chain
+
+        pc = ret - 1; // Point inside the call instruction
+        fp = next_fp;
+    }
+
+    // Hash the call stack and count it
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; i < stack.depth; i++) {
+        hash = (hash ^ stack.frames[i]) * 1099511628211ULL;
+    }
+
+    struct profile_stack** bucket = &vm->profile->buckets[hash % PROFILE_BUCKETS];
+    struct profile_stack* current;
+    for (current = *bucket; current; current = current->next) {
+        if (current->depth == stack.depth && memcmp(current->frames, stack.frames, sizeof(uint64_t) * stack.depth) == 0) break;
+    }
+    if (current == NULL) {
+        current = malloc(sizeof(struct profile_stack));
+        if (current == NULL) {
+            vm->profile->lost++;
+            return;
+        }
+        *current = stack;
+        current->count = 0;
+        current->next = *bucket;
+        *bucket = current;
+    }
+
+    current->count++;
+    vm->profile->samples++;
 }
 
 /**
- * Writes a character to a file.
+ * Writes the name of a profiled frame, falling back to the address when it is not symbolized.
  *
- * @param vm Pointer to the guest structure.
- * @param data Character to write.
- * @return 0 on success.
+ * @param out Output stream.
+ * @param frame Frame address.
  */
-int write_file(struct guest* vm, char data) {
-    if (vm->current_file == NULL) {
-        *((char*)vm->kvm_run + vm->kvm_run->io.data_offset) = EOF;
-        return 0;
+void print_frame(FILE* out, uint64_t frame) {
+    struct symbol* sym = find_symbol(frame);
+    if (sym) {
+        fprintf(out, "%s", sym->name);
+    } else {
+        fprintf(out, "0x%" PRIx64, frame);
     }
-
-    write(vm->current_file->fd, &data, 1);
-    return 0;
 }
 
 /**
- * Handles file operations (open, close, read, write) for the guest VM.
+ * Writes the call stacks collected for the guest VM in the folded format used by flamegraph tools,
+ * and prints the functions with the most samples.
  *
  * @param vm Pointer to the guest structure.
- * @return 0 on success.
+ * @param out Folded stacks output stream.
  */
-int handle_file(struct guest* vm) {
-    if (vm->kvm_run->io.direction == KVM_EXIT_IO_OUT && vm->kvm_run->io.size == sizeof(int)) {
-        int data = *((int*)((char*)vm->kvm_run + vm->kvm_run->io.data_offset));
+void report_profile(struct guest* vm, FILE* out) {
+    struct { uint64_t frame; uint64_t count; } top[PROFILE_TOP] = {0};
+    struct { uint64_t frame; uint64_t count; }* self = NULL;
+    int num_self = 0;
 
-        if (vm->lock == 0) {
-            return start_file_operation(vm, data);
-        } else if (vm->lock == OPEN) {
-            return opened_file_op_flags(vm, data);
-        } else if (data == FINISH) {
-            return end_file_operation(vm);
-        } else {
-            return get_file_descriptor(vm, data);
-        }
-    } else if (vm->kvm_run->io.direction == KVM_EXIT_IO_OUT && vm->kvm_run->io.size == sizeof(char)) {
-        char data = *((char*)vm->kvm_run + vm->kvm_run->io.data_offset);
-        if (vm->lock == OPEN) {
-            return opened_file_op_name(vm, data);
-        } else if (vm->lock == WRITE) {
-            return write_file(vm, data);
+    for (int b = 0; b < PROFILE_BUCKETS; b++) {
+        for (struct profile_stack* stack = vm->profile->buckets[b]; stack; stack = stack->next) {
+            // One folded line per stack, outermost frame first
+            fprintf(out, "vm%d", vm->id);
+            for (int i = stack->depth - 1; i >= 0; i--) {
+                fputc(';', out);
+                print_frame(out, stack->frames[i]);
+            }
+            fprintf(out, " %" PRIu64 "\n", stack->count);
+
+            // Accumulate the self samples of the innermost frame
+            int i;
+            for (i = 0; i < num_self && self[i].frame != stack->frames[0]; i++);
+            if (i == num_self) {
+                self = realloc(self, sizeof(*self) * ++num_self);
+                self[i].frame = stack->frames[0];
+                self[i].count = 0;
+            }
+            self[i].count += stack->count;
         }
-    } else if (vm->kvm_run->io.direction == KVM_EXIT_IO_IN && vm->kvm_run->io.size == sizeof(int)) {
-        if (vm->lock == CLOSE) {
-            return close_op_status(vm);
-        } else if (vm->lock == OPEN) {
-            return opened_file_op_send_fd(vm);
+    }
+
+    // Select the functions with the most self samples
+    for (int i = 0; i < num_self; i++) {
+        for (int j = 0; j < PROFILE_TOP; j++) {
+            if (self[i].count > top[j].count) {
+                memmove(&top[j + 1], &top[j], sizeof(top[0]) * (PROFILE_TOP - j - 1));
+                top[j].frame = self[i].frame;
+                top[j].count = self[i].count;
+                break;
+            }
         }
-    } else if (vm->kvm_run->io.direction == KVM_EXIT_IO_IN && vm->kvm_run->io.size == sizeof(char)) {
-        if (vm->lock == READ) {
-            return read_file(vm);
+    }
+
+    printf("Profile of VM %d: %" PRIu64 " samples, %" PRIu64 " lost\n", vm->id, vm->profile->samples, vm->profile->lost);
+    for (int j = 0; j < PROFILE_TOP && top[j].count; j++) {
+        printf("  %6.2f%%  %8" PRIu64 "  ", 100.0 * top[j].count / vm->profile->samples, top[j].count);
+        print_frame(stdout, top[j].frame);
+        printf("\n");
+    }
+
+    free(self);
+}
+
+/**
+ * Runs the sampling thread, which periodically kicks every running vCPU so it records a sample.
+ *
+ * @param par Unused.
+ * @return NULL on completion.
+ */
+void* run_profiler(void* par) {
+    (void)par;
+    long interval_ns = 1000000000L / profiler.hz;
+    struct timespec interval = { .tv_sec = interval_ns / 1000000000L, .tv_nsec = interval_ns % 1000000000L };
+
+    while (!profiler.stop) {
+        nanosleep(&interval, NULL);
+
+        pthread_mutex_lock(&profiler_lock);
+        for (int i = 0; i < num_guests; i++) {
+            if (guests[i]->running) {
+                pthread_kill(guests[i]->thread, SIGUSR1);
+            }
         }
+        pthread_mutex_unlock(&profiler_lock);
     }
 
-    return 0;
+    return NULL;
 }
 
+// Regions of guest memory laid out by setup_long_mode and setup_registers
+enum MemRegion {REGION_PAGE_TABLES, REGION_IMAGE, REGION_STACK, REGION_HEAP, NUM_REGIONS};
+static const char* region_names[] = {"page_tables", "image", "stack", "heap"};
+
+// Structure representing the memory accounting of a guest VM
+struct memory_stats {
+    uint64_t start[NUM_REGIONS]; // Guest physical start of each region
+    uint64_t end[NUM_REGIONS]; // Guest physical end of each region
+    uint64_t resident[NUM_REGIONS]; // Resident bytes per region at the last sample
+    uint64_t peak[NUM_REGIONS]; // Peak resident bytes per region
+    uint64_t total; // Resident bytes at the last sample
+    uint64_t peak_total; // Peak resident bytes
+    uint64_t huge; // Bytes backed by transparent huge pages at the last sample
+    uint64_t peak_huge; // Peak bytes backed by transparent huge pages
+    uint64_t samples; // Number of samples taken
+    unsigned char* vec; // Residency vector filled by mincore
+};
+
+// Structure representing the thread sampling the memory of all guest VMs
+struct memory_monitor {
+    int interval_ms; // Sampling interval, 0 if memory accounting is disabled
+    volatile int stop; // Set to stop the sampling thread
+};
+
+struct memory_monitor memory_monitor;
+
 /**
- * Handles IO exits for the guest VM, including pseudoterminal communication and file operations.
+ * Splits the guest memory into the page table, image, stack and heap regions.
+ * The page tables occupy the memory below the image, the stack spans from the end of the image up to
+ * the initial stack pointer, and the heap is everything mapped above it.
  *
  * @param vm Pointer to the guest structure.
- * @return 0 on success, -1 on failure.
  */
-int exit_io(struct guest* vm) {
-    if (vm->kvm_run->io.direction == KVM_EXIT_IO_OUT && vm->kvm_run->io.port == 0xE9) {
-        char c = *((char*)vm->kvm_run + vm->kvm_run->io.data_offset);
-        write(vm->pty_master, &c, vm->kvm_run->io.size);
-        return 0;
-    } else if (vm->kvm_run->io.direction == KVM_EXIT_IO_IN && vm->kvm_run->io.port == 0xE9) {
-        char c;
-        read(vm->pty_master, &c, sizeof(char));
-        *((char*)vm->kvm_run + vm->kvm_run->io.data_offset) = c;
-        return 0;
-    } else if (vm->kvm_run->io.port == 0x278) {
-        handle_file(vm);
-    } else {
-        fprintf(stderr, "Invalid port %d\n", vm->kvm_run->io.port);
-        return -1;
+void init_memory_stats(struct guest* vm) {
+    struct memory_stats* stats = vm->memory;
+    uint64_t image_end = vm->starting_address + vm->image_size;
+    uint64_t stack_top = vm->starting_address + GUEST_STACK_TOP;
+    if (stack_top > vm->mem_size) stack_top = vm->mem_size;
+    if (image_end > stack_top) image_end = stack_top;
+
+    stats->start[REGION_PAGE_TABLES] = 0;
+    stats->end[REGION_PAGE_TABLES] = vm->starting_address;
+    stats->start[REGION_IMAGE] = vm->starting_address;
+    stats->end[REGION_IMAGE] = image_end;
+    stats->start[REGION_STACK] = image_end;
+    stats->end[REGION_STACK] = stack_top;
+    stats->start[REGION_HEAP] = stack_top;
+    stats->end[REGION_HEAP] = vm->mem_size;
+
+    stats->vec = malloc(vm->mem_size / PAGE_SIZE);
+}
+
+/**
+ * Reads how much of a mapping of this process is backed by transparent huge pages.
+ *
+ * @param addr Start address of the mapping.
+ * @return Number of bytes backed by huge pages.
+ */
+uint64_t huge_page_bytes(void* addr) {
+    char line[256];
+    unsigned long start, end, kb;
+    uint64_t huge = 0;
+    int in_mapping = 0;
+
+    FILE* smaps = fopen("/proc/self/smaps", "r");
+    if (smaps == NULL) return 0;
+
+    while (fgets(line, sizeof(line), smaps)) {
+        // Mapping headers start with the address range, the fields of the mapping follow them
+        if (sscanf(line, "%lx-%lx", &start, &end) == 2) {
+            if (in_mapping) break;
+            in_mapping = start == (unsigned long)addr;
+        } else if (in_mapping) {
+            // Shared anonymous memory is shmem, count both kinds of huge page mappings
+            if (sscanf(line, "AnonHugePages: %lu kB", &kb) == 1 || sscanf(line, "ShmemPmdMapped: %lu kB", &kb) == 1) {
+                huge += kb * 1024;
+            }
+        }
     }
+
+    fclose(smaps);
+    return huge;
 }
 
 /**
- * Handles internal errors for the guest VM.
+ * Samples which pages of the guest memory are resident and updates the per-region peaks.
  *
  * @param vm Pointer to the guest structure.
- * @return -1 to indicate an error.
  */
-int exit_internal_error(struct guest* vm) {
-    printf("ERROR: Internal error: suberror = 0x%x\n", vm->kvm_run->internal.suberror);
-    return -1;
+void sample_memory(struct guest* vm) {
+    struct memory_stats* stats = vm->memory;
+    if (stats->vec == NULL || mincore(vm->mem, vm->mem_size, stats->vec) < 0) return;
+
+    uint64_t resident[NUM_REGIONS] = {0};
+    int region = 0;
+    for (uint64_t page = 0; page < vm->mem_size / PAGE_SIZE; page++) {
+        uint64_t gpa = page * PAGE_SIZE;
+        while (region < NUM_REGIONS - 1 && gpa >= stats->end[region]) region++;
+        if (stats->vec[page] & 1) resident[region] += PAGE_SIZE;
+    }
+
+    stats->total = 0;
+    for (int i = 0; i < NUM_REGIONS; i++) {
+        stats->resident[i] = resident[i];
+        if (resident[i] > stats->peak[i]) stats->peak[i] = resident[i];
+        stats->total += resident[i];
+    }
+    if (stats->total > stats->peak_total) stats->peak_total = stats->total;
+
+    stats->huge = huge_page_bytes(vm->mem);
+    if (stats->huge > stats->peak_huge) stats->peak_huge = stats->huge;
+
+    stats->samples++;
 }
 
 /**
- * Handles shutdown exits for the guest VM.
+ * Prints the resident memory of the guest VM per region, with the peaks seen while it was running.
  *
  * @param vm Pointer to the guest structure.
- * @return 1 to indicate the VM should stop running.
  */
-int exit_shutdown(struct guest* vm) {
-    printf("Shutdown\n");
-    return 1;
+void report_memory(struct guest* vm) {
+    struct memory_stats* stats = vm->memory;
+
+    printf("Memory of VM %d: peak %" PRIu64 " KB resident of %zu KB (%.1f%%), peak %" PRIu64 " KB in huge pages, %" PRIu64 " samples\n",
+           vm->id, stats->peak_total / 1024, vm->mem_size / 1024, 100.0 * stats->peak_total / vm->mem_size,
+           stats->peak_huge / 1024, stats->samples);
+    for (int i = 0; i < NUM_REGIONS; i++) {
+        printf("  %-12s %8" PRIu64 " KB resident, peak %8" PRIu64 " KB of %8" PRIu64 " KB\n", region_names[i],
+               stats->resident[i] / 1024, stats->peak[i] / 1024, (stats->end[i] - stats->start[i]) / 1024);
+    }
 }
 
-// Typedef for the exit handlers
-typedef int (*Handler)(struct guest* vm);
+/**
+ * Runs the memory sampling thread, which periodically samples every running guest VM.
+ *
+ * @param par Unused.
+ * @return NULL on completion.
+ */
+void* run_memory_monitor(void* par) {
+    (void)par;
+    struct timespec interval = {
+        .tv_sec = memory_monitor.interval_ms / 1000,
+        .tv_nsec = (memory_monitor.interval_ms % 1000) * 1000000L
+    };
 
-// Array of exit handlers
-static Handler handlers[] = {
-    NULL, NULL, &exit_io, NULL, NULL, &exit_halt,
-    NULL, NULL, &exit_shutdown, NULL, NULL,
-    NULL, NULL, NULL, NULL, NULL, NULL,
-    &exit_internal_error
-};
+    while (!memory_monitor.stop) {
+        for (int i = 0; i < num_guests; i++) {
+            if (guests[i]->running) sample_memory(guests[i]);
+        }
+        nanosleep(&interval, NULL);
+    }
+
+    return NULL;
+}
+
+/**
+ * Writes the metrics of the guest VM in the Prometheus text format.
+ *
+ * @param vm Pointer to the guest structure.
+ * @param out Output stream.
+ */
+void write_metrics(struct guest* vm, FILE* out) {
+    fprintf(out, "minihv_guest_memory_bytes{vm=\"%d\"} %zu\n", vm->id, vm->mem_size);
+    fprintf(out, "minihv_file_copies_total{vm=\"%d\"} %" PRIu64 "\n", vm->id, vm->file_copies);
+    fprintf(out, "minihv_file_copy_bytes_total{vm=\"%d\"} %" PRIu64 "\n", vm->id, vm->file_copy_bytes);
+    static const char* batch_names[] = {"open", "stat", "readdir"};
+    for (int i = 0; i < 3; i++) {
+        fprintf(out, "minihv_file_batched_total{vm=\"%d\",op=\"%s\"} %" PRIu64 "\n", vm->id, batch_names[i], vm->file_batched[i]);
+    }
+    // Files still open are counted with the policy they have now
+    uint64_t access_files[NUM_ACCESS_POLICIES];
+    memcpy(access_files, vm->access_files, sizeof(access_files));
+    for (struct file* file = vm->file_head; file; file = file->next) {
+        access_files[file->access.policy]++;
+    }
+    for (int i = 0; i < NUM_ACCESS_POLICIES; i++) {
+        fprintf(out, "minihv_file_policy_files{vm=\"%d\",policy=\"%s\"} %" PRIu64 "\n", vm->id, access_policy_names[i], access_files[i]);
+    }
+    for (int i = 0; i < vm->num_access_reports; i++) {
+        struct access_report* report = &vm->access_reports[i];
+        fprintf(out, "minihv_file_policy_requests{vm=\"%d\",file=\"%s\",policy=\"%s\"} %" PRIu64 "\n", vm->id, report->name, access_policy_names[report->policy], report->requests);
+    }
+    fprintf(out, "minihv_file_readahead_bytes_total{vm=\"%d\"} %" PRIu64 "\n", vm->id, vm->access_readahead_bytes);
+    fprintf(out, "minihv_file_dropped_bytes_total{vm=\"%d\"} %" PRIu64 "\n", vm->id, vm->access_dropped_bytes);
+    for (int i = PATH_OVERLAY; i < NUM_PATH_STATES; i++) {
+        fprintf(out, "minihv_path_cache_hits_total{vm=\"%d\",path=\"%s\"} %" PRIu64 "\n", vm->id, path_state_names[i], vm->paths->hits[i]);
+    }
+    fprintf(out, "minihv_path_cache_misses_total{vm=\"%d\"} %" PRIu64 "\n", vm->id, vm->paths->misses);
+    fprintf(out, "minihv_path_cache_stale_total{vm=\"%d\"} %" PRIu64 "\n", vm->id, vm->paths->stale);
+    if (dedup.dir) {
+        fprintf(out, "minihv_dedup_stored_total{vm=\"%d\"} %" PRIu64 "\n", vm->id, vm->dedup.stored);
+        fprintf(out, "minihv_dedup_linked_total{vm=\"%d\",kind=\"hardlink\"} %" PRIu64 "\n", vm->id, vm->dedup.links);
+        fprintf(out, "minihv_dedup_linked_total{vm=\"%d\",kind=\"reflink\"} %" PRIu64 "\n", vm->id, vm->dedup.reflinks);
+        fprintf(out, "minihv_dedup_saved_bytes_total{vm=\"%d\"} %" PRIu64 "\n", vm->id, vm->dedup.saved_bytes);
+        fprintf(out, "minihv_dedup_hashed_bytes_total{vm=\"%d\"} %" PRIu64 "\n", vm->id, vm->dedup.hashed_bytes);
+        fprintf(out, "minihv_dedup_hash_seconds_total{vm=\"%d\"} %.9f\n", vm->id, vm->dedup.hash_ns / 1e9);
+        fprintf(out, "minihv_dedup_unshares_total{vm=\"%d\"} %" PRIu64 "\n", vm->id, vm->dedup.unshares);
+    }
+    fprintf(out, "minihv_stream_bytes_total{vm=\"%d\"} %" PRIu64 "\n", vm->id, vm->stream_bytes);
+    fprintf(out, "minihv_stream_fills_total{vm=\"%d\"} %" PRIu64 "\n", vm->id, vm->stream_fills);
+    fprintf(out, "minihv_stream_waits_total{vm=\"%d\"} %" PRIu64 "\n", vm->id, vm->stream_waits);
+    struct file_queue* queue = vm->file_queue;
+    if (queue->ring) {
+        fprintf(out, "minihv_file_ring_doorbells_total{vm=\"%d\"} %" PRIu64 "\n", vm->id, queue->doorbells);
+        fprintf(out, "minihv_file_ring_requests_total{vm=\"%d\"} %" PRIu64 "\n", vm->id, queue->submitted);
+        fprintf(out, "minihv_file_ring_completions_total{vm=\"%d\"} %" PRIu64 "\n", vm->id, queue->completed);
+        fprintf(out, "minihv_file_ring_waits_total{vm=\"%d\"} %" PRIu64 "\n", vm->id, queue->waits);
+        fprintf(out, "minihv_file_queue_depth{vm=\"%d\"} %u\n", vm->id, queue->depth);
+        fprintf(out, "minihv_file_queue_depth_peak{vm=\"%d\"} %u\n", vm->id, queue->peak_depth);
+        fprintf(out, "minihv_file_queue_wait_seconds_sum{vm=\"%d\"} %.9f\n", vm->id, queue->wait_ns / 1e9);
+        fprintf(out, "minihv_file_queue_wait_seconds_max{vm=\"%d\"} %.9f\n", vm->id, queue->max_wait_ns / 1e9);
+        fprintf(out, "minihv_file_queue_stolen_total{vm=\"%d\"} %" PRIu64 "\n", vm->id, queue->stolen);
+    }
+
+    if (vm->memory) {
+        struct memory_stats* stats = vm->memory;
+        for (int i = 0; i < NUM_REGIONS; i++) {
+            fprintf(out, "minihv_memory_region_bytes{vm=\"%d\",region=\"%s\"} %" PRIu64 "\n", vm->id, region_names[i], stats->end[i] - stats->start[i]);
+            fprintf(out, "minihv_memory_resident_bytes{vm=\"%d\",region=\"%s\"} %" PRIu64 "\n", vm->id, region_names[i], stats->resident[i]);
+            fprintf(out, "minihv_memory_resident_peak_bytes{vm=\"%d\",region=\"%s\"} %" PRIu64 "\n", vm->id, region_names[i], stats->peak[i]);
+        }
+        fprintf(out, "minihv_memory_huge_bytes{vm=\"%d\"} %" PRIu64 "\n", vm->id, stats->huge);
+        fprintf(out, "minihv_memory_huge_peak_bytes{vm=\"%d\"} %" PRIu64 "\n", vm->id, stats->peak_huge);
+        fprintf(out, "minihv_memory_samples_total{vm=\"%d\"} %" PRIu64 "\n", vm->id, stats->samples);
+    }
+
+    struct io_account* io = vm->io;
+    fprintf(out, "minihv_io_weight{vm=\"%d\"} %u\n", vm->id, io->weight);
+    fprintf(out, "minihv_io_requests_total{vm=\"%d\"} %" PRIu64 "\n", vm->id, io->requests);
+    fprintf(out, "minihv_io_bytes_total{vm=\"%d\"} %" PRIu64 "\n", vm->id, io->bytes_total);
+    fprintf(out, "minihv_io_throttled_total{vm=\"%d\"} %" PRIu64 "\n", vm->id, io->throttled);
+    fprintf(out, "minihv_io_throttled_seconds_total{vm=\"%d\"} %.9f\n", vm->id, io->throttled_ns / 1e9);
+    fprintf(out, "minihv_io_queued_seconds_total{vm=\"%d\"} %.9f\n", vm->id, io->queued_ns / 1e9);
+    fprintf(out, "minihv_io_durability{vm=\"%d\",mode=\"%s\"} 1\n", vm->id, durability_names[io->durability]);
+    fprintf(out, "minihv_commit_wait_seconds_sum{vm=\"%d\"} %.9f\n", vm->id, io->commit_ns / 1e9);
+    fprintf(out, "minihv_commit_wait_seconds_count{vm=\"%d\"} %" PRIu64 "\n", vm->id, io->commits);
+    fprintf(out, "minihv_commit_wait_seconds_max{vm=\"%d\"} %.9f\n", vm->id, io->max_commit_ns / 1e9);
+
+    if (vm->blk) {
+        fprintf(out, "minihv_blk_requests_total{vm=\"%d\"} %" PRIu64 "\n", vm->id, vm->blk->requests);
+        fprintf(out, "minihv_blk_batches_total{vm=\"%d\"} %" PRIu64 "\n", vm->id, vm->blk->batches);
+        fprintf(out, "minihv_blk_doorbells_total{vm=\"%d\"} %" PRIu64 "\n", vm->id, vm->blk->doorbells);
+        fprintf(out, "minihv_blk_read_bytes_total{vm=\"%d\"} %" PRIu64 "\n", vm->id, vm->blk->bytes_read);
+        fprintf(out, "minihv_blk_written_bytes_total{vm=\"%d\"} %" PRIu64 "\n", vm->id, vm->blk->bytes_written);
+        fprintf(out, "minihv_blk_errors_total{vm=\"%d\"} %" PRIu64 "\n", vm->id, vm->blk->errors);
+    }
+
+    struct irq_line* lines[NUM_IRQ_DEVICES] = {
+        vm->console ? &vm->console->irq : NULL,
+        vm->blk && vm->blk->async ? &vm->blk->irq : NULL
+    };
+    for (int i = 0; i < NUM_IRQ_DEVICES; i++) {
+        if (lines[i] == NULL) continue;
+        fprintf(out, "minihv_irq_raised_total{vm=\"%d\",device=\"%s\"} %" PRIu64 "\n", vm->id, irq_device_names[i], lines[i]->raised);
+        fprintf(out, "minihv_irq_completions_total{vm=\"%d\",device=\"%s\"} %" PRIu64 "\n", vm->id, irq_device_names[i], lines[i]->completions);
+    }
+
+    uint64_t window_bytes = 0;
+    for (int i = 0; i < vm->num_windows; i++) {
+        window_bytes += vm->windows[i].size;
+    }
+    fprintf(out, "minihv_windows{vm=\"%d\"} %d\n", vm->id, vm->num_windows);
+    fprintf(out, "minihv_window_bytes{vm=\"%d\"} %" PRIu64 "\n", vm->id, window_bytes);
+
+    if (vm->shm_addr) {
+        fprintf(out, "minihv_shm_bytes{vm=\"%d\"} %" PRIu64 "\n", vm->id, shared_memory.size);
+        fprintf(out, "minihv_shm_doorbells_total{vm=\"%d\"} %" PRIu64 "\n", vm->id, vm->doorbells);
+    }
+
+    fprintf(out, "minihv_msg_sent_total{vm=\"%d\"} %" PRIu64 "\n", vm->id, vm->msg->sent);
+    fprintf(out, "minihv_msg_dropped_total{vm=\"%d\"} %" PRIu64 "\n", vm->id, vm->msg->dropped);
+    fprintf(out, "minihv_msg_overflows_total{vm=\"%d\"} %" PRIu64 "\n", vm->id, vm->msg->overflows);
+    fprintf(out, "minihv_msg_wakeups_total{vm=\"%d\"} %" PRIu64 "\n", vm->id, vm->msg->wakeups);
+    for (int i = 0; i < num_guests; i++) {
+        struct msg_pair* pair = &vm->msg->pairs[i];
+        if (pair->messages == 0) continue;
+        fprintf(out, "minihv_msg_delivered_total{vm=\"%d\",src=\"%d\"} %" PRIu64 "\n", vm->id, i, pair->messages);
+        fprintf(out, "minihv_msg_delivered_bytes_total{vm=\"%d\",src=\"%d\"} %" PRIu64 "\n", vm->id, i, pair->bytes);
+        fprintf(out, "minihv_msg_latency_seconds_sum{vm=\"%d\",src=\"%d\"} %.9f\n", vm->id, i, pair->latency_ns / 1e9);
+        fprintf(out, "minihv_msg_latency_seconds_max{vm=\"%d\",src=\"%d\"} %.9f\n", vm->id, i, pair->max_latency_ns / 1e9);
+    }
+
+    if (vm->profile) {
+        fprintf(out, "minihv_profile_samples_total{vm=\"%d\"} %" PRIu64 "\n", vm->id, vm->profile->samples);
+        fprintf(out, "minihv_profile_lost_total{vm=\"%d\"} %" PRIu64 "\n", vm->id, vm->profile->lost);
+    }
+}
 
 /**
  * Runs the guest VM in a loop, handling exit reasons using the handlers array.
@@ -712,11 +5678,22 @@ void* run_guest(void* par) {
     while (stop == 0) {
         // Run the virtual CPU
         ret = ioctl(vm->vm_vcpu, KVM_RUN, 0);
+
+        // Take a sample if the profiler kicked this vCPU
+        if (sample_pending) {
+            sample_pending = 0;
+            if (vm->profile) profile_sample(vm);
+        }
+
         if (ret < 0) {
+            // The profiler signal interrupts KVM_RUN, resume the guest
+            if (errno == EINTR) continue;
+
             // Print an error message if the ioctl call fails
             perror("ERROR: Failed ioctl KVM_RUN\n");
             fprintf(stderr, "KVM_RUN: %s\n", strerror(errno));
-            return NULL;
+            stop = -1;
+            break;
         }
 
         int exit_reason = vm->kvm_run->exit_reason; // Get the exit reason
@@ -730,6 +5707,34 @@ void* run_guest(void* par) {
         }
     }
 
+    vm->failed = stop < 0;
+
+    // Stop the profiler from kicking this thread
+    pthread_mutex_lock(&profiler_lock);
+    vm->running = 0;
+    pthread_mutex_unlock(&profiler_lock);
+
+    // Wake guests waiting for a doorbell or message this guest can no longer send
+    pthread_mutex_lock(&doorbell_lock);
+    pthread_cond_broadcast(&doorbell_cond);
+    pthread_mutex_unlock(&doorbell_lock);
+    for (int i = 0; i < num_guests; i++) {
+        msg_wake(guests[i]);
+    }
+
+    // Finish the file operation the guest stopped in the middle of
+    if (vm->lock != 0) end_file_operation(vm);
+
+    // Let the workers finish the guest's requests
+    drain_file_queue(vm);
+
+    // Stop the device threads serving this guest
+    if (vm->blk && vm->blk->async) stop_blk_device(vm);
+    if (vm->console) stop_console(vm);
+    for (int i = 0; i < MAX_STREAMS; i++) {
+        if (vm->streams[i]) stop_stream(vm, i);
+    }
+
     return NULL;
 }
 
@@ -750,9 +5755,14 @@ pthread_t start_guest(struct guest* vm, FILE* img, int starting_address) {
         int r = fread(p, 1, 1024, img);
         p += r;
     }
+    vm->image_size = p - (vm->mem + starting_address);
+
+    // Split the guest memory into regions now that the image size is known
+    if (vm->memory) init_memory_stats(vm);
 
     // Create a new thread to run the guest VM
     if (pthread_create(&handle, NULL, &run_guest, vm) == 0) {
+        vm->thread = handle;
         return handle;
     } else {
         return -1;
@@ -775,16 +5785,38 @@ int init_guest(struct hypervisor* hypervisor, struct guest* vm, size_t mem_size,
     int starting_address;
 
     if (create_guest(hypervisor, vm) < 0) return -1;
+    if (hypervisor->irqchip && create_irqchip(vm) < 0) return -1;
     if (create_memory_region(vm, mem_size) < 0) return -1;
     if (create_vcpu(vm) < 0) return -1;
     if (create_kvm_run(hypervisor, vm) < 0) return -1;
+    if (setup_cpuid(hypervisor, vm) < 0) return -1;
     if ((starting_address = setup_long_mode(vm, mem_size, page_size)) < 0) return -1;
     if (setup_registers(vm) < 0) return -1;
-    vm->lock = 0;
-    vm->file_head = NULL;
+    if (setup_fpu(vm) < 0) return -1;
+    pthread_mutex_init(&vm->files_lock, NULL);
+    pthread_cond_init(&vm->files_cond, NULL);
+    pthread_mutex_init(&vm->dedup_lock, NULL);
     vm->file_indirect = &vm->file_head;
-    vm->current_file = NULL;
+    if (init_path_cache(vm) < 0) return -1;
+    if (init_file_queue(vm) < 0) return -1;
     vm->id = incId++;
+    if (init_io_account(vm) < 0) return -1;
+    if (setup_terminal(vm) < 0) return -1;
+    vm->mem_size = mem_size;
+    vm->starting_address = starting_address;
+    vm->running = 1; // Counted as running from now on, so guests started earlier wait for it
+    if (init_msg_device(vm) < 0) return -1;
+    if (hypervisor->irqchip && init_console(vm) < 0) return -1;
+    if (blk_config.path && init_blk_device(vm, hypervisor->irqchip) < 0) return -1;
+    if (shared_memory.mem && (vm->shm_addr = map_window(vm, shared_memory.mem, shared_memory.size, 1)) == 0) return -1;
+    if (memory_monitor.interval_ms) {
+        vm->memory = calloc(1, sizeof(struct memory_stats));
+        if (vm->memory == NULL) return -1;
+    }
+    if (profiler.hz) {
+        vm->profile = calloc(1, sizeof(struct profile));
+        if (vm->profile == NULL) return -1;
+    }
 
     return starting_address;
 }
@@ -795,25 +5827,43 @@ int init_guest(struct hypervisor* hypervisor, struct guest* vm, size_t mem_size,
  *
  * @param argc Argument count.
  * @param argv Argument vector.
- * @return 0 on success, exits with EXIT_FAILURE on failure.
+ * @return 0 on success, EXIT_FAILURE if a guest stopped on an error, exits with EXIT_FAILURE on other failures.
  */
 int main(int argc, char* argv[]) {
     int opt;
     int memory = 0; // Memory size in bytes
     enum PageSize page_size; // Page size
-    struct hypervisor hypervisor;
+    struct hypervisor hypervisor = { 0 };
     int starting_address;
+    const char* metrics_path = NULL; // Path of the metrics output file
 
     // Define the command line options
     struct option long_options[] = {
         {"memory", required_argument, 0, 'm'},
         {"page", required_argument, 0, 'p'},
         {"guest", no_argument, 0, 'g'},
+        {"profile", required_argument, 0, 'P'},
+        {"profile-depth", required_argument, 0, 'D'},
+        {"profile-out", required_argument, 0, 'O'},
+        {"symbols", required_argument, 0, 'S'},
+        {"mem-sample", required_argument, 0, 'M'},
+        {"metrics", required_argument, 0, 'E'},
+        {"disk", required_argument, 0, 'k'},
+        {"disk-queue", required_argument, 0, 'q'},
+        {"shm", required_argument, 0, 's'},
+        {"irqchip", no_argument, 0, 'i'},
+        {"irq-moderation", required_argument, 0, 'R'},
+        {"io-limit", required_argument, 0, 'L'},
+        {"io-weight", required_argument, 0, 'W'},
+        {"dedup", required_argument, 0, 'd'},
+        {"durability", required_argument, 0, 'y'},
+        {"file-workers", required_argument, 0, 'w'},
+        {"cpu", required_argument, 0, 'c'},
         {0, 0, 0, 0,}
     };
 
     // Parse the command line options
-    while ((opt = getopt_long(argc, argv, "m:p:g", long_options, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "m:p:gP:D:O:S:M:E:k:q:s:iR:L:W:d:y:w:c:", long_options, NULL)) != -1) {
         switch (opt) {
             case 'm':
                 memory = atoi(optarg) * 1024 * 1024; // Convert memory size to bytes
@@ -823,6 +5873,87 @@ int main(int argc, char* argv[]) {
                 break;
             case 'g':
                 break;
+            case 'P':
+                profiler.hz = atoi(optarg); // Set the sampling frequency
+                break;
+            case 'D':
+                profiler.depth = atoi(optarg); // Set the number of frames walked per sample
+                if (profiler.depth < 1 || profiler.depth > PROFILE_MAX_DEPTH) profiler.depth = PROFILE_MAX_DEPTH;
+                break;
+            case 'O':
+                profiler.out_path = optarg; // Set the folded stacks output file
+                break;
+            case 'S':
+                // Load the guest symbols used to symbolize the samples
+                if (load_symbols(optarg) < 0) exit(EXIT_FAILURE);
+                break;
+            case 'M':
+                memory_monitor.interval_ms = atoi(optarg); // Set the memory sampling interval
+                break;
+            case 'E':
+                metrics_path = optarg; // Set the metrics output file
+                break;
+            case 'k':
+                blk_config.path = optarg; // Set the disk image backing the block devices
+                break;
+            case 'i':
+                hypervisor.irqchip = 1; // Give the guests interrupt controllers and a timer
+                break;
+            case 'R':
+                // Set how completions of a device are coalesced into interrupts
+                if (parse_irq_moderation(optarg) < 0) {
+                    printf("ERROR: Invalid interrupt moderation %s, expected <console|blk>=<coalesce>/<delay_us>\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'L':
+            case 'W':
+                // Limit the rates of the guests' file and block requests, or set their share of the host I/O
+                if (parse_io_config(optarg, opt == 'W' ? IO_CONFIG_WEIGHT : IO_CONFIG_LIMIT) < 0) {
+                    printf("ERROR: Invalid I/O %s %s, expected [<id>=]%s\n", opt == 'W' ? "weight" : "limit", optarg,
+                           opt == 'W' ? "<weight>" : "<bytes_per_s>/<ops_per_s>");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'y':
+                // Set when the guests' writes are synced
+                if (parse_io_config(optarg, IO_CONFIG_DURABILITY) < 0) {
+                    printf("ERROR: Invalid durability %s, expected [<id>=]<none|close|flush>\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'd':
+                // Deduplicate the guests' outputs into a content-addressed store
+                if (mkdir(optarg, 0755) < 0 && errno != EEXIST) {
+                    perror("ERROR: Failed to create dedup store\n");
+                    fprintf(stderr, "mkdir: %s\n", strerror(errno));
+                    exit(EXIT_FAILURE);
+                }
+                dedup.dir = optarg;
+                break;
+            case 's':
+                // Allocate the memory shared by all guest VMs
+                if (create_shared_memory((uint64_t)atoi(optarg) * 1024 * 1024) < 0) exit(EXIT_FAILURE);
+                break;
+            case 'w':
+                worker_pool.size = atoi(optarg); // Set the number of workers executing file ring requests
+                if (worker_pool.size < 1 || worker_pool.size > FILE_WORKERS_MAX) worker_pool.size = FILE_WORKERS_MAX;
+                break;
+            case 'c':
+                // Set the CPU model of the guests, the host CPU or a baseline shared by a fleet of hosts
+                hypervisor.cpu_model = NUM_CPU_MODELS;
+                for (int i = 0; i < NUM_CPU_MODELS; i++) {
+                    if (strcmp(optarg, cpu_model_names[i]) == 0) hypervisor.cpu_model = i;
+                }
+                if (hypervisor.cpu_model == NUM_CPU_MODELS) {
+                    printf("ERROR: Invalid CPU model %s, expected host, x86-64, x86-64-v2, x86-64-v3, x86-64-v4 or scalar\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'q':
+                blk_config.queue_size = atoi(optarg); // Set the queue depth of the block devices
+                if (blk_config.queue_size < 1 || blk_config.queue_size > BLK_QUEUE_MAX) blk_config.queue_size = BLK_QUEUE_MAX;
+                break;
         }
     }
 
@@ -832,17 +5963,25 @@ int main(int argc, char* argv[]) {
         exit(EXIT_FAILURE);
     }
 
+    // As many requests use the host I/O at once as there are workers, so the pool is not serialized
+    io_scheduler.slots = worker_pool.size;
+
     int num_of_vms = argc - optind; // Number of guest VMs
     pthread_t* vms = (pthread_t*)malloc(sizeof(pthread_t) * num_of_vms); // Array of thread handles for the guest VMs
+    guests = (struct guest**)malloc(sizeof(struct guest*) * num_of_vms); // Array of the guest VMs
+    num_guests = num_of_vms;
 
-    // Initialize the semaphore for synchronizing file operations
-    if (sem_init(&file_mutex, 0, 1) < 0) {
-        perror("ERROR: Failed sem_init\n");
-        fprintf(stderr, "sem_init: %s\n", strerror(errno));
-        exit(EXIT_FAILURE);
+    // Kicks from the profiler interrupt KVM_RUN, other system calls are restarted
+    if (profiler.hz > 0) {
+        struct sigaction action = { .sa_handler = profile_signal, .sa_flags = SA_RESTART };
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGUSR1, &action, NULL);
     }
 
-    // Initialize and start each guest VM
+    FILE** imgs = (FILE**)malloc(sizeof(FILE*) * num_of_vms); // Array of the guest image files
+    int* starting_addresses = (int*)malloc(sizeof(int) * num_of_vms); // Array of the image load addresses
+
+    // Initialize each guest VM, all of them exist before any starts so they can address each other
     for (int i = optind; i < argc; i++) {
         // Open the guest image file
         FILE* img = fopen(argv[i], "r");
@@ -852,7 +5991,7 @@ int main(int argc, char* argv[]) {
         }
 
         // Allocate memory for the guest VM structure
-        struct guest* vm = malloc(sizeof(struct guest));
+        struct guest* vm = calloc(1, sizeof(struct guest)); // Fields not set by init_guest start out zero
         if (vm == NULL) {
             printf("ERROR: Memory allocation failed\n");
             printf("fopen: %s\n", strerror(errno));
@@ -865,16 +6004,89 @@ int main(int argc, char* argv[]) {
             exit(EXIT_FAILURE);
         }
 
-        // Start the guest VM in a new thread
-        pthread_t handle = start_guest(vm, img, starting_address);
-        vms[argc - i - 1] = handle;
+        guests[argc - i - 1] = vm;
+        imgs[argc - i - 1] = img;
+        starting_addresses[argc - i - 1] = starting_address;
+    }
+
+    // Start each guest VM in a new thread
+    for (int i = num_of_vms - 1; i >= 0; i--) {
+        vms[i] = start_guest(guests[i], imgs[i], starting_addresses[i]);
+    }
+
+    // Start sampling the guest VMs
+    pthread_t profiler_thread;
+    if (profiler.hz > 0) {
+        if (pthread_create(&profiler_thread, NULL, &run_profiler, NULL) != 0) {
+            printf("ERROR: Unable to start profiler\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Start sampling the memory of the guest VMs
+    pthread_t memory_thread;
+    if (memory_monitor.interval_ms > 0) {
+        if (pthread_create(&memory_thread, NULL, &run_memory_monitor, NULL) != 0) {
+            printf("ERROR: Unable to start memory monitor\n");
+            exit(EXIT_FAILURE);
+        }
     }
 
-    // Wait for all guest threads to complete
+    // Wait for all guest threads to complete, the hypervisor fails if any guest stopped on an error
+    int status = 0;
     for (int i = 0; i < num_of_vms; i++) {
         pthread_join(vms[i], NULL);
+        if (guests[i]->failed) status = EXIT_FAILURE;
+    }
+
+    // No guest can submit requests or request syncs anymore
+    stop_file_workers();
+    stop_group_commit();
+
+    // Stop the memory monitor and report the final and peak usage
+    if (memory_monitor.interval_ms > 0) {
+        memory_monitor.stop = 1;
+        pthread_join(memory_thread, NULL);
+
+        for (int i = num_of_vms - 1; i >= 0; i--) {
+            sample_memory(guests[i]);
+            report_memory(guests[i]);
+        }
+    }
+
+    // Stop the profiler and write the collected call stacks
+    if (profiler.hz > 0) {
+        profiler.stop = 1;
+        pthread_join(profiler_thread, NULL);
+
+        FILE* out = fopen(profiler.out_path, "w");
+        if (out == NULL) {
+            printf("ERROR: Unable to open file %s\n", profiler.out_path);
+            exit(EXIT_FAILURE);
+        }
+        for (int i = num_of_vms - 1; i >= 0; i--) {
+            report_profile(guests[i], out);
+        }
+        fclose(out);
+    }
+
+    // Write the metrics of all guest VMs
+    if (metrics_path) {
+        FILE* out = fopen(metrics_path, "w");
+        if (out == NULL) {
+            printf("ERROR: Unable to open file %s\n", metrics_path);
+            exit(EXIT_FAILURE);
+        }
+        for (int i = num_of_vms - 1; i >= 0; i--) {
+            write_metrics(guests[i], out);
+        }
+        write_commit_metrics(out);
+        fclose(out);
     }
 
+    free(guests);
+    free(imgs);
+    free(starting_addresses);
     free(vms);
-    return 0;
+    return status;
 }